@@ -0,0 +1,41 @@
+//! End-to-end request benchmarks against the real route table. The app is
+//! driven in-process through actix's test service, so numbers cover routing,
+//! middleware and handler work but not socket I/O; criterion's sample
+//! distribution gives the tail latencies.
+
+use actix_web::{test, web, App};
+use criterion::{criterion_group, criterion_main, Criterion};
+use harmonia::config::Config;
+use harmonia::configure_routes;
+
+fn bench_routes(c: &mut Criterion) {
+    let rt = tokio::runtime::Builder::new_current_thread()
+        .enable_all()
+        .build()
+        .expect("Failed to build runtime");
+    let app = rt.block_on(test::init_service(
+        App::new()
+            .app_data(web::Data::new(Config::default()))
+            .configure(configure_routes),
+    ));
+
+    // routes that do not need a live nix-daemon or store
+    for (name, uri) in [
+        ("http_version", "/version"),
+        ("http_nix_cache_info", "/nix-cache-info"),
+        ("http_metrics", "/metrics"),
+    ] {
+        c.bench_function(name, |b| {
+            b.iter(|| {
+                rt.block_on(async {
+                    let req = test::TestRequest::get().uri(uri).to_request();
+                    let res = test::call_service(&app, req).await;
+                    assert!(res.status().is_success(), "{} -> {}", uri, res.status());
+                })
+            })
+        });
+    }
+}
+
+criterion_group!(benches, bench_routes);
+criterion_main!(benches);
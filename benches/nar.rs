@@ -0,0 +1,133 @@
+//! Criterion benchmarks for the hot paths of the cache: NAR serialization
+//! over different store-path shapes, `.ls` generation, and the signing
+//! primitives. Run with `cargo bench`.
+
+use std::fs;
+use std::path::{Path, PathBuf};
+
+use actix_web::web::Bytes;
+use criterion::{criterion_group, criterion_main, Criterion, Throughput};
+use harmonia::nar::{dump_path_windowed, NarSink, ThreadSafeError};
+use harmonia::narlist::get_nar_list;
+use harmonia::signing::{convert_base16_to_nix32, fingerprint_path, parse_secret_key, sign_string, to_nix_base32};
+
+fn runtime() -> tokio::runtime::Runtime {
+    tokio::runtime::Builder::new_current_thread()
+        .enable_all()
+        .build()
+        .expect("Failed to build runtime")
+}
+
+/// Serializes `path` and returns the NAR size, draining the chunk channel
+/// the way a response stream would.
+async fn dump(path: PathBuf) -> u64 {
+    let (tx, mut rx) = tokio::sync::mpsc::channel::<Result<Bytes, ThreadSafeError>>(32);
+    tokio::task::spawn(dump_path_windowed(path, NarSink::full(tx)));
+    let mut total = 0u64;
+    while let Some(chunk) = rx.recv().await {
+        total += chunk.expect("dump failed").len() as u64;
+    }
+    total
+}
+
+/// Lots of small files spread over subdirectories; the typical shape of
+/// interpreter or documentation outputs. Walk overhead dominates.
+fn many_small_files(root: &Path) {
+    for d in 0..16 {
+        let dir = root.join(format!("dir{:02}", d));
+        fs::create_dir_all(&dir).unwrap();
+        for f in 0..64 {
+            fs::write(dir.join(format!("file{:02}", f)), vec![b'a'; 4096]).unwrap();
+        }
+    }
+}
+
+/// A couple of large blobs; read throughput dominates.
+fn few_huge_files(root: &Path) {
+    fs::create_dir_all(root).unwrap();
+    for f in 0..2 {
+        fs::write(root.join(format!("blob{}", f)), vec![b'b'; 16 * 1024 * 1024]).unwrap();
+    }
+}
+
+/// A deeply nested chain of directories; stack handling and frame
+/// bookkeeping dominate.
+fn deep_tree(root: &Path) {
+    let mut dir = root.to_path_buf();
+    for _ in 0..48 {
+        dir = dir.join("d");
+        fs::create_dir_all(&dir).unwrap();
+        fs::write(dir.join("file"), vec![b'c'; 512]).unwrap();
+    }
+}
+
+fn bench_dump(c: &mut Criterion) {
+    let rt = runtime();
+    let temp_dir = tempfile::tempdir().expect("Failed to create temp dir");
+
+    let corpora: [(&str, fn(&Path)); 3] = [
+        ("many_small_files", many_small_files),
+        ("few_huge_files", few_huge_files),
+        ("deep_tree", deep_tree),
+    ];
+
+    let mut group = c.benchmark_group("nar_dump");
+    for (name, build) in corpora {
+        let root = temp_dir.path().join(name);
+        build(&root);
+        let nar_size = rt.block_on(dump(root.clone()));
+        group.throughput(Throughput::Bytes(nar_size));
+        group.bench_function(name, |b| b.iter(|| rt.block_on(dump(root.clone()))));
+    }
+    group.finish();
+}
+
+fn bench_narlist(c: &mut Criterion) {
+    let rt = runtime();
+    let temp_dir = tempfile::tempdir().expect("Failed to create temp dir");
+    let root = temp_dir.path().join("corpus");
+    many_small_files(&root);
+
+    c.bench_function("narlist_generate", |b| {
+        b.iter(|| {
+            let list = rt
+                .block_on(get_nar_list(root.clone()))
+                .expect("Failed to generate listing");
+            serde_json::to_string(&list).expect("Failed to serialize listing")
+        })
+    });
+}
+
+fn bench_signing(c: &mut Criterion) {
+    let digest = [0x5au8; 32];
+    c.bench_function("to_nix_base32", |b| b.iter(|| to_nix_base32(&digest)));
+
+    let hex: String = digest.iter().map(|b| format!("{:02x}", b)).collect();
+    c.bench_function("convert_base16_to_nix32", |b| {
+        b.iter(|| convert_base16_to_nix32(&hex).expect("Failed to convert"))
+    });
+
+    let temp_dir = tempfile::tempdir().expect("Failed to create temp dir");
+    let key_path = temp_dir.path().join("bench.secret");
+    let key64 = {
+        use base64::Engine as _;
+        base64::engine::general_purpose::STANDARD.encode([7u8; 64])
+    };
+    fs::write(&key_path, format!("bench-1:{}", key64)).unwrap();
+    let key = parse_secret_key(&key_path).expect("Failed to parse key");
+
+    let store_path = format!("/nix/store/{}-bench-1.0", "a".repeat(32));
+    let nar_hash = format!("sha256:{}", "b".repeat(52));
+    let refs = vec![store_path.clone(); 8];
+    c.bench_function("fingerprint_and_sign", |b| {
+        b.iter(|| {
+            let fingerprint = fingerprint_path("/nix/store", &store_path, &nar_hash, 4096, &refs)
+                .expect("Failed to fingerprint")
+                .expect("missing fingerprint");
+            sign_string(&key, &fingerprint)
+        })
+    });
+}
+
+criterion_group!(benches, bench_dump, bench_narlist, bench_signing);
+criterion_main!(benches);
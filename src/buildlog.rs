@@ -49,13 +49,7 @@ pub(crate) async fn get(
     settings: web::Data<Config>,
 ) -> Result<HttpResponse, Box<dyn std::error::Error>> {
     let drv_path = some_or_404!(query_drv_path(&settings, &drv).await);
-    match settings
-        .store
-        .daemon
-        .lock()
-        .await
-        .is_valid_path(&drv_path)
-        .await
+    match settings.store.daemon().await.is_valid_path(&drv_path).await
     {
         Ok(true) => (),
         Ok(false) => {
@@ -88,6 +82,11 @@ pub(crate) async fn get(
         .unwrap_or("");
 
     if ext == "bz2" && !accept_encoding.contains("bzip2") {
+        // serve from the recompressed log cache when possible: repeated
+        // bunzip2 of big logs is expensive, and the cache adds Range support
+        if let Some(res) = crate::logcache::try_serve(&settings, &build_log, &req).await? {
+            return Ok(res);
+        }
         // Decompress the bz2 file and serve the decompressed content
         let file = tokio::fs::File::open(&build_log)
             .await
@@ -0,0 +1,106 @@
+use std::collections::HashMap;
+use std::hash::{DefaultHasher, Hash, Hasher};
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+const SHARDS: usize = 16;
+
+#[derive(Debug)]
+struct Entry<V> {
+    value: V,
+    expires: Instant,
+}
+
+/// A bounded, sharded in-memory cache with per-entry TTL.
+///
+/// Keys are distributed over a fixed number of shards, each guarded by its
+/// own mutex, so concurrent lookups from different actix workers don't
+/// serialize on a single lock. When a shard is full, expired entries are
+/// swept first and otherwise the entry closest to expiry is evicted.
+#[derive(Debug)]
+pub(crate) struct Cache<K, V> {
+    shards: Vec<Mutex<HashMap<K, Entry<V>>>>,
+    shard_capacity: usize,
+}
+
+impl<K: Eq + Hash, V: Clone> Cache<K, V> {
+    pub(crate) fn new(capacity: usize) -> Self {
+        Self {
+            shards: (0..SHARDS).map(|_| Mutex::new(HashMap::new())).collect(),
+            shard_capacity: capacity.div_ceil(SHARDS).max(1),
+        }
+    }
+
+    fn shard(&self, key: &K) -> &Mutex<HashMap<K, Entry<V>>> {
+        let mut hasher = DefaultHasher::new();
+        key.hash(&mut hasher);
+        &self.shards[hasher.finish() as usize % SHARDS]
+    }
+
+    pub(crate) fn get(&self, key: &K) -> Option<V> {
+        let mut shard = self.shard(key).lock().expect("cache lock poisoned");
+        match shard.get(key) {
+            Some(entry) if entry.expires > Instant::now() => Some(entry.value.clone()),
+            Some(_) => {
+                shard.remove(key);
+                None
+            }
+            None => None,
+        }
+    }
+
+    pub(crate) fn insert(&self, key: K, value: V, ttl: Duration) {
+        let now = Instant::now();
+        let mut shard = self.shard(&key).lock().expect("cache lock poisoned");
+        if shard.len() >= self.shard_capacity && !shard.contains_key(&key) {
+            shard.retain(|_, entry| entry.expires > now);
+        }
+        if shard.len() >= self.shard_capacity && !shard.contains_key(&key) {
+            // evict the entry closest to expiry
+            if let Some(min_expires) = shard.values().map(|entry| entry.expires).min() {
+                shard.retain(|_, entry| entry.expires > min_expires);
+            }
+        }
+        shard.insert(
+            key,
+            Entry {
+                value,
+                expires: now + ttl,
+            },
+        );
+    }
+
+    /// Drops all entries, e.g. when the data they were derived from changed.
+    pub(crate) fn clear(&self) {
+        for shard in &self.shards {
+            shard.lock().expect("cache lock poisoned").clear();
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_cache_expiry_and_bound() {
+        let cache: Cache<String, u64> = Cache::new(SHARDS);
+        cache.insert("a".into(), 1, Duration::from_secs(60));
+        assert_eq!(cache.get(&"a".into()), Some(1));
+
+        cache.insert("b".into(), 2, Duration::from_secs(0));
+        assert_eq!(cache.get(&"b".into()), None);
+
+        // each shard holds at most one entry, inserting into the same shard
+        // twice must evict rather than grow
+        for i in 0..100u64 {
+            cache.insert(format!("key{}", i), i, Duration::from_secs(60));
+        }
+        let total: usize = cache
+            .shards
+            .iter()
+            .map(|shard| shard.lock().unwrap().len())
+            .sum();
+        assert!(total <= SHARDS);
+    }
+}
@@ -1,9 +1,16 @@
+use crate::db::NixDb;
+use crate::logcache::LogCache;
+use crate::narcache::NarCache;
+use crate::pathindex::PathIndex;
 use crate::signing::parse_secret_key;
-use crate::store::Store;
+use crate::spool::SpoolRegistry;
+use crate::store::{CacheConfig, DaemonPool, Store};
 use anyhow::{Context, Result};
 use serde::Deserialize;
 use std::fs::read_to_string;
 use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::Duration;
 
 fn default_bind() -> String {
     "[::]:5000".into()
@@ -21,19 +28,124 @@ fn default_priority() -> usize {
     30
 }
 
+fn default_daemon_min_connections() -> usize {
+    1
+}
+
+fn default_daemon_max_connections() -> usize {
+    32
+}
+
+fn default_daemon_idle_timeout() -> u64 {
+    300
+}
+
+fn default_metadata_cache_entries() -> usize {
+    32 * 1024
+}
+
+fn default_metadata_cache_ttl() -> u64 {
+    15 * 60
+}
+
+fn default_metadata_cache_negative_ttl() -> u64 {
+    10
+}
+
+fn default_compression_level() -> i32 {
+    3
+}
+
+fn default_compression_jobs() -> usize {
+    2
+}
+
+fn default_io_uring_workers() -> usize {
+    4
+}
+
+fn default_nar_chunk_size() -> usize {
+    256 * 1024
+}
+
+fn default_nar_channel_depth() -> usize {
+    32
+}
+
+fn default_warming_jobs() -> usize {
+    2
+}
+
+fn default_nix_db_path() -> PathBuf {
+    "/nix/var/nix/db/db.sqlite".into()
+}
+
+/// How file contents are read while serializing NARs.
+#[derive(Deserialize, Debug, Default, Clone, Copy, PartialEq)]
+#[serde(rename_all = "lowercase")]
+pub(crate) enum IoEngine {
+    /// tokio's file I/O (the spawn_blocking pool).
+    #[default]
+    Tokio,
+    /// Dedicated io_uring reader threads; falls back to tokio when the
+    /// kernel or container does not allow rings.
+    Uring,
+}
+
+/// Where metadata lookups (hash part -> store path, path info) are answered from.
+#[derive(Deserialize, Debug, Default, Clone, Copy, PartialEq)]
+#[serde(rename_all = "lowercase")]
+pub(crate) enum MetadataBackend {
+    /// The nix-daemon worker protocol.
+    #[default]
+    Daemon,
+    /// Read-only queries against the Nix SQLite database, with the daemon as fallback.
+    Sqlite,
+}
+
 fn default_virtual_store() -> String {
     "/nix/store".into()
 }
 
 #[derive(Debug)]
-pub(crate) struct SigningKey {
+pub struct SigningKey {
     pub(crate) name: String,
     pub(crate) key: Vec<u8>,
 }
 
+/// The parsed signing keys behind a swappable handle: signing reads the
+/// current pointer, a SIGHUP-driven reload swaps in a freshly parsed set.
+/// Key rotation this way doesn't require a restart that would drop all
+/// in-flight NAR streams.
+#[derive(Debug, Default)]
+pub struct SigningKeys {
+    inner: std::sync::RwLock<Arc<Vec<SigningKey>>>,
+}
+
+impl SigningKeys {
+    pub(crate) fn get(&self) -> Arc<Vec<SigningKey>> {
+        self.inner.read().expect("signing key lock poisoned").clone()
+    }
+
+    pub(crate) fn replace(&self, keys: Vec<SigningKey>) {
+        *self.inner.write().expect("signing key lock poisoned") = Arc::new(keys);
+    }
+}
+
+/// Parses all keys in `paths`; used at startup and again on SIGHUP.
+pub(crate) fn parse_signing_keys(paths: &[PathBuf]) -> Result<Vec<SigningKey>> {
+    paths
+        .iter()
+        .map(|path| {
+            parse_secret_key(path)
+                .with_context(|| format!("Couldn't parse secret key from '{}'", path.display()))
+        })
+        .collect()
+}
+
 // TODO(conni2461): users to restrict access
 #[derive(Deserialize, Debug, Default)]
-pub(crate) struct Config {
+pub struct Config {
     #[serde(default = "default_bind")]
     pub(crate) bind: String,
     #[serde(default = "default_workers")]
@@ -43,6 +155,85 @@ pub(crate) struct Config {
     #[serde(default = "default_priority")]
     pub(crate) priority: usize,
 
+    #[serde(default = "default_daemon_min_connections")]
+    pub(crate) daemon_min_connections: usize,
+    #[serde(default = "default_daemon_max_connections")]
+    pub(crate) daemon_max_connections: usize,
+    /// Seconds an idle daemon connection is kept before being closed.
+    #[serde(default = "default_daemon_idle_timeout")]
+    pub(crate) daemon_idle_timeout: u64,
+
+    #[serde(default = "default_metadata_cache_entries")]
+    pub(crate) metadata_cache_entries: usize,
+    #[serde(default = "default_metadata_cache_ttl")]
+    pub(crate) metadata_cache_ttl: u64,
+    /// Seconds a cached miss is kept; short so newly added paths show up quickly.
+    #[serde(default = "default_metadata_cache_negative_ttl")]
+    pub(crate) metadata_cache_negative_ttl: u64,
+
+    #[serde(default)]
+    pub(crate) io_engine: IoEngine,
+    #[serde(default = "default_io_uring_workers")]
+    pub(crate) io_uring_workers: usize,
+
+    /// Read/chunk size in bytes for NAR streaming.
+    #[serde(default = "default_nar_chunk_size")]
+    pub(crate) nar_chunk_size: usize,
+    /// Chunks buffered per response stream. Together with `nar_chunk_size`
+    /// this caps the streaming memory a slow client can pin
+    /// (`depth * chunk_size` per in-flight download); the total across all
+    /// clients is exported as `harmonia_nar_buffered_bytes`.
+    #[serde(default = "default_nar_channel_depth")]
+    pub(crate) nar_channel_depth: usize,
+    /// NAR member files at least this many bytes large have their pages
+    /// dropped from the page cache after streaming (`POSIX_FADV_DONTNEED`),
+    /// so one-time multi-GiB downloads don't evict the hot metadata working
+    /// set. Disabled when unset.
+    #[serde(default)]
+    pub(crate) nar_dropbehind_threshold: Option<u64>,
+
+    #[serde(default)]
+    pub(crate) metadata_backend: MetadataBackend,
+    #[serde(default = "default_nix_db_path")]
+    pub(crate) nix_db_path: PathBuf,
+
+    /// File backing the persistent hash-part index; resolution becomes an
+    /// in-memory probe and survives restarts. Disabled when unset.
+    #[serde(default)]
+    pub(crate) hash_index_path: Option<PathBuf>,
+
+    /// Directory for spooling in-flight NAR serializations so concurrent
+    /// downloads of the same NAR share one pass; disabled when unset.
+    #[serde(default)]
+    pub(crate) nar_spool_dir: Option<PathBuf>,
+
+    /// Directory for the persistent compressed-NAR cache; compression is
+    /// disabled when unset.
+    #[serde(default)]
+    pub(crate) compressed_nar_cache: Option<PathBuf>,
+    /// Directory for build logs recompressed from bzip2 to zstd; disabled
+    /// when unset.
+    #[serde(default)]
+    pub(crate) build_log_cache: Option<PathBuf>,
+    #[serde(default = "default_compression_level")]
+    pub(crate) compression_level: i32,
+    /// Maximum number of concurrent background compression jobs.
+    #[serde(default = "default_compression_jobs")]
+    pub(crate) compression_jobs: usize,
+
+    /// Bearer token required by `POST /warm`; the endpoint is disabled when
+    /// unset.
+    #[serde(default)]
+    pub(crate) warming_token: Option<String>,
+    /// Maximum number of store paths warmed concurrently per request.
+    #[serde(default = "default_warming_jobs")]
+    pub(crate) warming_jobs: usize,
+
+    /// Base URLs of upstream binary caches queried (concurrently,
+    /// first-wins) when a narinfo or NAR is not in the local store.
+    #[serde(default)]
+    pub(crate) upstream_caches: Vec<String>,
+
     #[serde(default = "default_virtual_store")]
     pub(crate) virtual_nix_store: String,
 
@@ -58,9 +249,15 @@ pub(crate) struct Config {
     pub(crate) tls_key_path: Option<String>,
 
     #[serde(skip, default)]
-    pub(crate) secret_keys: Vec<SigningKey>,
+    pub(crate) secret_keys: SigningKeys,
     #[serde(skip)]
     pub(crate) store: Store,
+    #[serde(skip)]
+    pub(crate) nar_cache: Option<NarCache>,
+    #[serde(skip)]
+    pub(crate) nar_spool: Option<SpoolRegistry>,
+    #[serde(skip)]
+    pub(crate) log_cache: Option<LogCache>,
 }
 
 pub(crate) fn load() -> Result<Config> {
@@ -93,17 +290,70 @@ pub(crate) fn load() -> Result<Config> {
             settings.sign_key_paths.push(PathBuf::from(sign_key_path));
         }
     }
-    for sign_key_path in &settings.sign_key_paths {
-        settings
-            .secret_keys
-            .push(parse_secret_key(sign_key_path).with_context(|| {
-                format!(
-                    "Couldn't parse secret key from '{}'",
-                    sign_key_path.display()
-                )
-            })?);
+    settings
+        .secret_keys
+        .replace(parse_signing_keys(&settings.sign_key_paths)?);
+    if settings.io_engine == IoEngine::Uring {
+        crate::uring::init(settings.io_uring_workers);
     }
+    settings.nar_spool = settings.nar_spool_dir.clone().map(SpoolRegistry::new);
+    settings.nar_cache = settings.compressed_nar_cache.clone().map(|dir| {
+        NarCache::new(
+            dir,
+            settings.compression_level,
+            settings.compression_jobs,
+        )
+    });
+    settings.log_cache = settings.build_log_cache.clone().map(|dir| {
+        LogCache::new(
+            dir,
+            settings.compression_level,
+            settings.compression_jobs,
+        )
+    });
     let store_dir = std::env::var("NIX_STORE_DIR").unwrap_or(settings.virtual_nix_store.clone());
-    settings.store = Store::new(store_dir, settings.real_nix_store.clone());
+    let nix_db = match settings.metadata_backend {
+        MetadataBackend::Daemon => None,
+        MetadataBackend::Sqlite => Some(NixDb::new(
+            settings.nix_db_path.clone(),
+            store_dir.clone(),
+        )),
+    };
+    let index = match &settings.hash_index_path {
+        Some(path) => {
+            let index = Arc::new(
+                PathIndex::load(path.clone()).context("Failed to load hash index")?,
+            );
+            // build/compact in the background; lookups work off the loaded
+            // file meanwhile
+            let store_scan_dir = PathBuf::from(
+                settings.real_nix_store.as_ref().unwrap_or(&store_dir),
+            );
+            let scan = index.clone();
+            tokio::task::spawn(async move {
+                if let Err(e) = scan.scan(store_scan_dir).await {
+                    log::warn!("hash index scan failed: {:#}", e);
+                }
+            });
+            Some(index)
+        }
+        None => None,
+    };
+    settings.store = Store::new(
+        store_dir,
+        settings.real_nix_store.clone(),
+        DaemonPool::new(
+            settings.daemon_min_connections,
+            settings.daemon_max_connections,
+            Duration::from_secs(settings.daemon_idle_timeout),
+        ),
+        nix_db,
+        index,
+        CacheConfig {
+            entries: settings.metadata_cache_entries,
+            ttl: Duration::from_secs(settings.metadata_cache_ttl),
+            negative_ttl: Duration::from_secs(settings.metadata_cache_negative_ttl),
+        },
+    );
     Ok(settings)
 }
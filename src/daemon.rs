@@ -10,7 +10,7 @@ use tokio::{
 const SOCKET_PATH: &str = "/nix/var/nix/daemon-socket/socket";
 
 #[derive(Debug, Default)]
-pub(crate) struct DaemonConnection {
+pub struct DaemonConnection {
     socket: Option<UnixStream>,
     #[allow(dead_code)]
     server_features: Vec<String>,
@@ -167,7 +167,7 @@ impl TryFrom<u64> for OpCode {
     }
 }
 
-#[derive(Debug, PartialEq)]
+#[derive(Debug, Clone, PartialEq)]
 pub(crate) struct ValidPathInfo {
     pub deriver: String,
     pub hash: String,
@@ -458,6 +458,12 @@ async fn forward_stderr(socket: &mut UnixStream) -> Result<()> {
 }
 
 impl DaemonConnection {
+    /// Forces the lazy connect + handshake now instead of on the first RPC;
+    /// used to pre-warm the pool at startup.
+    pub(crate) async fn ensure_connected(&mut self) -> Result<()> {
+        self.connect().await.map(|_| ())
+    }
+
     async fn connect(&mut self) -> Result<&mut UnixStream> {
         if let Some(ref mut socket) = self.socket {
             Ok(socket)
@@ -606,12 +612,19 @@ impl DaemonConnection {
             .await
             .context("Failed to forward stderr")?;
 
+        Ok(QueryPathInfoResponse {
+            path: self.read_path_info().await?,
+        })
+    }
+
+    /// Reads the reply of a `QueryPathInfo` op (after stderr has been drained).
+    async fn read_path_info(&mut self) -> Result<Option<ValidPathInfo>> {
         let optional = self
             .read_num::<u64>()
             .await
             .context("Failed to read optional")?;
         if optional == 0 {
-            return Ok(QueryPathInfoResponse { path: None });
+            return Ok(None);
         }
         let mut path_info = ValidPathInfo {
             deriver: self.read_string().await.context("Failed to read deriver")?,
@@ -644,9 +657,68 @@ impl DaemonConnection {
             path_info.content_address = None;
         }
 
-        Ok(QueryPathInfoResponse {
-            path: Some(path_info),
-        })
+        Ok(Some(path_info))
+    }
+
+    /// How many pipelined ops are written before their replies are read.
+    /// Writing a whole 4k batch back-to-back can deadlock: the daemon's
+    /// replies fill its socket send buffer before it has read all requests,
+    /// it blocks writing and stops reading, and both sides wait forever. A
+    /// few hundred ops stay well below the buffer sizes while keeping the
+    /// round-trip savings.
+    const PIPELINE_DEPTH: usize = 256;
+
+    /// Resolves many hash parts to store paths and fetches their path info,
+    /// pipelining the ops on the daemon socket: the requests of a phase are
+    /// written back-to-back in chunks of `PIPELINE_DEPTH` and each chunk's
+    /// replies read before the next is written, so a batch costs two round
+    /// trips per chunk instead of two per path.
+    pub(crate) async fn query_path_infos_from_hash_parts(
+        &mut self,
+        hash_parts: &[String],
+    ) -> Result<Vec<Option<(String, ValidPathInfo)>>> {
+        let mut paths = Vec::with_capacity(hash_parts.len());
+        for chunk in hash_parts.chunks(Self::PIPELINE_DEPTH) {
+            for hash_part in chunk {
+                self.send_op(OpCode::QueryPathFromHashPart)
+                    .await
+                    .context("Failed to send opcode")?;
+                self.write_string(hash_part)
+                    .await
+                    .context("Failed to write hash part")?;
+            }
+            for _ in chunk {
+                self.forward_stderr()
+                    .await
+                    .context("Failed to forward stderr")?;
+                let path = self.read_string().await.context("Failed to read path")?;
+                paths.push(if path.is_empty() { None } else { Some(path) });
+            }
+        }
+
+        let mut res = Vec::with_capacity(paths.len());
+        for chunk in paths.chunks(Self::PIPELINE_DEPTH) {
+            for path in chunk.iter().flatten() {
+                self.send_op(OpCode::QueryPathInfo)
+                    .await
+                    .context("Failed to send opcode")?;
+                self.write_string(path)
+                    .await
+                    .context("Failed to write path")?;
+            }
+            for path in chunk {
+                res.push(match path {
+                    Some(path) => {
+                        self.forward_stderr()
+                            .await
+                            .context("Failed to forward stderr")?;
+                        self.read_path_info().await?.map(|info| (path.clone(), info))
+                    }
+                    None => None,
+                });
+            }
+        }
+        Ok(res)
     }
 }
 
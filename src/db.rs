@@ -0,0 +1,156 @@
+use std::path::PathBuf;
+use std::sync::Mutex;
+
+use anyhow::{Context, Result};
+use rusqlite::{Connection, OpenFlags, OptionalExtension};
+
+use crate::daemon::ValidPathInfo;
+
+/// Read-only access to the Nix database (`/nix/var/nix/db/db.sqlite`).
+///
+/// Metadata lookups answered from the database directly bypass the nix-daemon
+/// worker protocol entirely, which keeps the request hot path alive even while
+/// the daemon is busy (e.g. during garbage collection). Connections are opened
+/// read-only and reused; queries run on the blocking pool.
+#[derive(Debug)]
+pub(crate) struct NixDb {
+    db_path: PathBuf,
+    virtual_store: String,
+    connections: Mutex<Vec<Connection>>,
+}
+
+impl NixDb {
+    pub(crate) fn new(db_path: PathBuf, virtual_store: String) -> Self {
+        Self {
+            db_path,
+            virtual_store,
+            connections: Mutex::new(Vec::new()),
+        }
+    }
+
+    fn connection(&self) -> Result<Connection> {
+        if let Some(connection) = self
+            .connections
+            .lock()
+            .expect("db connection lock poisoned")
+            .pop()
+        {
+            return Ok(connection);
+        }
+        let connection = Connection::open_with_flags(
+            &self.db_path,
+            OpenFlags::SQLITE_OPEN_READ_ONLY | OpenFlags::SQLITE_OPEN_NO_MUTEX,
+        )
+        .with_context(|| format!("Failed to open nix database: {}", self.db_path.display()))?;
+        // don't error out immediately when nix is check-pointing the WAL
+        connection
+            .busy_timeout(std::time::Duration::from_millis(500))
+            .context("Failed to set busy timeout")?;
+        Ok(connection)
+    }
+
+    fn put_back(&self, connection: Connection) {
+        self.connections
+            .lock()
+            .expect("db connection lock poisoned")
+            .push(connection);
+    }
+
+    pub(crate) async fn query_path_from_hash_part(
+        &self,
+        hash_part: &str,
+    ) -> Result<Option<String>> {
+        let connection = self.connection()?;
+        let prefix = format!("{}/{}", self.virtual_store, hash_part);
+        let (connection, res) = tokio::task::spawn_blocking(move || {
+            // same trick as nix' LocalStore: seek to the first path at or
+            // after the prefix, then check that it actually matches
+            let res = connection
+                .query_row(
+                    "select path from ValidPaths where path >= ? limit 1",
+                    [&prefix],
+                    |row| row.get::<_, String>(0),
+                )
+                .optional()
+                .context("Failed to query path from hash part");
+            (
+                connection,
+                res.map(|path| path.filter(|path| path.starts_with(&prefix))),
+            )
+        })
+        .await
+        .context("Failed to join blocking task")?;
+        self.put_back(connection);
+        res
+    }
+
+    pub(crate) async fn query_path_info(&self, store_path: &str) -> Result<Option<ValidPathInfo>> {
+        let connection = self.connection()?;
+        let store_path = store_path.to_owned();
+        let (connection, res) = tokio::task::spawn_blocking(move || {
+            let res = query_path_info_blocking(&connection, &store_path);
+            (connection, res)
+        })
+        .await
+        .context("Failed to join blocking task")?;
+        self.put_back(connection);
+        res
+    }
+}
+
+fn query_path_info_blocking(
+    connection: &Connection,
+    store_path: &str,
+) -> Result<Option<ValidPathInfo>> {
+    let row = connection
+        .query_row(
+            "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca \
+             from ValidPaths where path = ?",
+            [store_path],
+            |row| {
+                Ok((
+                    row.get::<_, i64>(0)?,
+                    row.get::<_, String>(1)?,
+                    row.get::<_, u64>(2)?,
+                    row.get::<_, Option<String>>(3)?,
+                    row.get::<_, u64>(4)?,
+                    row.get::<_, Option<u64>>(5)?,
+                    row.get::<_, Option<String>>(6)?,
+                    row.get::<_, Option<String>>(7)?,
+                ))
+            },
+        )
+        .optional()
+        .context("Failed to query path info")?;
+    let (id, hash, registration_time, deriver, nar_size, ultimate, sigs, ca) = match row {
+        Some(row) => row,
+        None => return Ok(None),
+    };
+
+    let mut stmt = connection
+        .prepare_cached(
+            "select path from Refs join ValidPaths on reference = id \
+             where referrer = ? order by path",
+        )
+        .context("Failed to prepare references query")?;
+    let references = stmt
+        .query_map([id], |row| row.get::<_, String>(0))
+        .context("Failed to query references")?
+        .collect::<Result<Vec<String>, _>>()
+        .context("Failed to read references")?;
+
+    Ok(Some(ValidPathInfo {
+        deriver: deriver.unwrap_or_default(),
+        // the database stores "sha256:<base16>", the daemon protocol (and
+        // everything downstream of it) uses bare base16
+        hash: hash.strip_prefix("sha256:").unwrap_or(&hash).to_owned(),
+        references,
+        registration_time,
+        nar_size,
+        ultimate: ultimate.unwrap_or(0) != 0,
+        sigs: sigs
+            .map(|sigs| sigs.split_whitespace().map(ToOwned::to_owned).collect())
+            .unwrap_or_default(),
+        content_address: ca.filter(|ca| !ca.is_empty()),
+    }))
+}
@@ -0,0 +1,228 @@
+use std::error::Error;
+use std::os::unix::fs::PermissionsExt;
+use std::path::{Component, Path, PathBuf};
+
+use actix_web::web::{Bytes, BytesMut};
+use actix_web::{http, web, HttpResponse};
+use anyhow::Context;
+use tokio::io::AsyncReadExt;
+use tokio::task;
+
+use crate::config::Config;
+use crate::nar::{AccountedStream, ThreadSafeError};
+use crate::{cache_control_max_age_1y, nixhash, some_or_404};
+
+/// The largest number of members accepted by a single extraction request.
+const MAX_MEMBERS: usize = 256;
+
+/// One selected member: the path as requested, its resolved location on
+/// disk, its size and whether the executable bit is set.
+struct Member {
+    path: String,
+    real_path: PathBuf,
+    size: u64,
+    executable: bool,
+}
+
+/// The part headers and epilogue of a multipart/mixed body for the given
+/// members, plus its total length including the file bytes themselves.
+fn multipart_envelope(boundary: &str, members: &[Member]) -> (Vec<Bytes>, Bytes, u64) {
+    let mut headers = Vec::with_capacity(members.len());
+    let mut total = 0u64;
+    for (i, member) in members.iter().enumerate() {
+        let header = format!(
+            "{}--{}\r\nContent-Type: application/octet-stream\r\nContent-Length: {}\r\nX-Member-Path: {}\r\n{}\r\n",
+            if i == 0 { "" } else { "\r\n" },
+            boundary,
+            member.size,
+            member.path,
+            if member.executable {
+                "X-Executable: 1\r\n"
+            } else {
+                ""
+            },
+        );
+        total += header.len() as u64 + member.size;
+        headers.push(Bytes::from(header));
+    }
+    let epilogue = Bytes::from(format!("\r\n--{}--\r\n", boundary));
+    total += epilogue.len() as u64;
+    (headers, epilogue, total)
+}
+
+async fn send(
+    tx: &tokio::sync::mpsc::Sender<Result<Bytes, ThreadSafeError>>,
+    data: Bytes,
+) -> bool {
+    let len = data.len() as u64;
+    crate::metrics::NAR_BUFFERED_BYTES.add(len);
+    if tx.send(Ok(data)).await.is_err() {
+        crate::metrics::NAR_BUFFERED_BYTES.sub(len);
+        return false; // client went away
+    }
+    true
+}
+
+/// Extracts selected files from a store path in one pass: takes a JSON array
+/// of member paths relative to the store path and streams just those files
+/// as a multipart/mixed body, read directly from disk. Grabbing a few
+/// binaries out of a multi-GiB closure this way costs exactly the bytes of
+/// the members instead of a full NAR dump or one request per file.
+pub(crate) async fn post(
+    hash: web::Path<String>,
+    members: web::Json<Vec<String>>,
+    settings: web::Data<Config>,
+) -> Result<HttpResponse, Box<dyn Error>> {
+    let hash = hash.into_inner();
+    let members = members.into_inner();
+    if members.is_empty() {
+        return Ok(HttpResponse::BadRequest().body("no members requested"));
+    }
+    if members.len() > MAX_MEMBERS {
+        return Ok(HttpResponse::BadRequest()
+            .body(format!("too many members, maximum is {}", MAX_MEMBERS)));
+    }
+
+    let store_path = some_or_404!(nixhash(&settings, &hash).await);
+    let root = settings.store.get_real_path(&PathBuf::from(&store_path));
+    let root = root
+        .canonicalize()
+        .with_context(|| format!("cannot resolve nix store path: {}", root.display()))?;
+
+    let mut resolved = Vec::with_capacity(members.len());
+    for member in members {
+        // only plain relative components; rejecting `..` and absolute paths
+        // up front keeps the canonicalize check below a second line of
+        // defense rather than the only one
+        if Path::new(&member)
+            .components()
+            .any(|c| !matches!(c, Component::Normal(_)))
+        {
+            return Ok(
+                HttpResponse::BadRequest().body(format!("invalid member path: {}", member))
+            );
+        }
+        let full_path = match root.join(&member).canonicalize() {
+            Ok(path) if path.starts_with(&root) => path,
+            _ => {
+                return Ok(HttpResponse::NotFound()
+                    .insert_header(crate::cache_control_no_store())
+                    .body(format!("no such member: {}", member)))
+            }
+        };
+        let metadata = full_path
+            .metadata()
+            .with_context(|| format!("cannot stat {}", full_path.display()))?;
+        if !metadata.is_file() {
+            return Ok(
+                HttpResponse::BadRequest().body(format!("not a regular file: {}", member))
+            );
+        }
+        resolved.push(Member {
+            path: member,
+            real_path: full_path,
+            size: metadata.len(),
+            executable: metadata.permissions().mode() & 0o100 != 0,
+        });
+    }
+
+    let boundary = format!(
+        "harmonia-{:016x}",
+        std::time::SystemTime::now()
+            .duration_since(std::time::UNIX_EPOCH)
+            .map(|d| d.as_nanos() as u64)
+            .unwrap_or(0)
+            ^ (std::process::id() as u64) << 32
+    );
+    let (headers, epilogue, total) = multipart_envelope(&boundary, &resolved);
+
+    let chunk_size = settings.nar_chunk_size;
+    let (tx, rx) = tokio::sync::mpsc::channel::<Result<Bytes, ThreadSafeError>>(
+        settings.nar_channel_depth.max(1),
+    );
+    let rx = AccountedStream::new(rx);
+    task::spawn(async move {
+        for (header, member) in headers.into_iter().zip(resolved) {
+            if !send(&tx, header).await {
+                return;
+            }
+            let mut file = match tokio::fs::File::open(&member.real_path).await {
+                Ok(file) => file,
+                Err(e) => {
+                    // the body falls short of the advertised length, so the
+                    // client sees a truncated transfer instead of bad data
+                    log::warn!("cannot open {}: {}", member.real_path.display(), e);
+                    return;
+                }
+            };
+            let mut left = member.size;
+            while left > 0 {
+                let mut buf = BytesMut::with_capacity(chunk_size.min(left as usize));
+                match file.read_buf(&mut buf).await {
+                    Ok(0) => return, // truncated since stat; bail out
+                    Ok(n) => {
+                        left = left.saturating_sub(n as u64);
+                        if !send(&tx, buf.freeze()).await {
+                            return;
+                        }
+                    }
+                    Err(e) => {
+                        log::warn!("cannot read {}: {}", member.real_path.display(), e);
+                        return;
+                    }
+                }
+            }
+        }
+        send(&tx, epilogue).await;
+    });
+
+    Ok(HttpResponse::Ok()
+        .insert_header((
+            http::header::CONTENT_TYPE,
+            format!("multipart/mixed; boundary={}", boundary),
+        ))
+        // don't allow compression middleware to break the part lengths
+        .insert_header((
+            http::header::CONTENT_ENCODING,
+            http::header::HeaderValue::from_static("identity"),
+        ))
+        .insert_header(cache_control_max_age_1y())
+        .body(actix_web::body::SizedStream::new(total, rx)))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_multipart_envelope() {
+        let members = vec![
+            Member {
+                path: "bin/hello".into(),
+                real_path: PathBuf::from("/dev/null"),
+                size: 10,
+                executable: true,
+            },
+            Member {
+                path: "share/doc/README".into(),
+                real_path: PathBuf::from("/dev/null"),
+                size: 3,
+                executable: false,
+            },
+        ];
+        let (headers, epilogue, total) = multipart_envelope("b", &members);
+        assert_eq!(headers.len(), 2);
+        assert_eq!(
+            headers[0],
+            "--b\r\nContent-Type: application/octet-stream\r\nContent-Length: 10\r\nX-Member-Path: bin/hello\r\nX-Executable: 1\r\n\r\n"
+        );
+        assert_eq!(
+            headers[1],
+            "\r\n--b\r\nContent-Type: application/octet-stream\r\nContent-Length: 3\r\nX-Member-Path: share/doc/README\r\n\r\n"
+        );
+        assert_eq!(epilogue, "\r\n--b--\r\n");
+        let envelope: u64 = headers.iter().map(|h| h.len() as u64).sum::<u64>()
+            + epilogue.len() as u64;
+        assert_eq!(total, envelope + 10 + 3);
+    }
+}
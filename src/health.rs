@@ -1,7 +1,23 @@
 use std::error::Error;
+use std::sync::atomic::{AtomicBool, Ordering};
 
 use actix_web::HttpResponse;
 
+/// Flipped once startup pre-warming (daemon connections, key parsing) has
+/// finished, so load balancer probes don't route traffic onto a cold
+/// instance.
+static READY: AtomicBool = AtomicBool::new(false);
+
+pub(crate) fn set_ready() {
+    READY.store(true, Ordering::Release);
+}
+
 pub(crate) async fn get() -> Result<HttpResponse, Box<dyn Error>> {
-    Ok(HttpResponse::Ok().body("OK\n"))
+    if READY.load(Ordering::Acquire) {
+        Ok(HttpResponse::Ok().body("OK\n"))
+    } else {
+        Ok(HttpResponse::ServiceUnavailable()
+            .insert_header(crate::cache_control_no_store())
+            .body("warming up\n"))
+    }
 }
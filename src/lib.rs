@@ -0,0 +1,362 @@
+#![warn(clippy::dbg_macro)]
+
+use actix_web::middleware;
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+use config::Config;
+use std::fs;
+use std::os::unix::fs::PermissionsExt;
+use std::path::Path;
+use std::{fmt::Display, time::Duration};
+use url::Url;
+
+use actix_web::{http, web, App, HttpResponse, HttpServer};
+use openssl::ssl::{SslAcceptor, SslFiletype, SslMethod};
+
+mod buildlog;
+mod cache;
+mod cacheinfo;
+mod closure;
+pub mod config;
+mod daemon;
+mod db;
+mod extract;
+mod health;
+mod logcache;
+mod metrics;
+pub mod nar;
+mod narcache;
+mod narinfo;
+pub mod narlist;
+mod pathindex;
+mod root;
+mod serve;
+pub mod signing;
+mod spool;
+mod store;
+mod upstream;
+mod uring;
+mod version;
+mod warming;
+
+async fn nixhash(settings: &web::Data<Config>, hash: &str) -> Option<String> {
+    if hash.len() != 32 {
+        return None;
+    }
+    settings
+        .store
+        .query_path_from_hash_part(hash)
+        .await
+        .unwrap_or(None)
+}
+
+const BOOTSTRAP_SOURCE: &str = r#"
+  <link href="https://cdn.jsdelivr.net/npm/bootstrap@5.2.3/dist/css/bootstrap.min.css"
+        rel="stylesheet"
+        integrity="sha384-rbsA2VBKQhggwzxH7pPCaAqO46MgnOM80zW1RWuH61DGLwZJEdK2Kadq2F9CUG65"
+         crossorigin="anonymous">
+  <script src="https://cdn.jsdelivr.net/npm/bootstrap@5.2.3/dist/js/bootstrap.bundle.min.js"
+          integrity="sha384-kenU1KFdBIe4zVF0s0G1M5b4hcpxyD9F7jL+jjXkk+Q2h455rYXK/7HAuoJl+0I4"
+          crossorigin="anonymous"></script>
+"#;
+
+const CARGO_NAME: &str = env!("CARGO_PKG_NAME");
+const CARGO_VERSION: &str = env!("CARGO_PKG_VERSION");
+const CARGO_HOME_PAGE: &str = env!("CARGO_PKG_HOMEPAGE");
+const NIXBASE32_ALPHABET: &str = "0123456789abcdfghijklmnpqrsvwxyz";
+
+fn cache_control_max_age(max_age: u32) -> http::header::CacheControl {
+    http::header::CacheControl(vec![http::header::CacheDirective::MaxAge(max_age)])
+}
+
+fn cache_control_max_age_1y() -> http::header::CacheControl {
+    cache_control_max_age(365 * 24 * 60 * 60)
+}
+
+fn cache_control_max_age_1d() -> http::header::CacheControl {
+    cache_control_max_age(24 * 60 * 60)
+}
+
+fn cache_control_no_store() -> http::header::CacheControl {
+    http::header::CacheControl(vec![http::header::CacheDirective::NoStore])
+}
+
+/// Evaluates request preconditions for an immutable resource with the strong
+/// entity tag `etag` (already quoted) and an optional modification time.
+/// Returns true when the client's copy is still valid, i.e. a 304 without a
+/// body should be served. Per RFC 9110, `If-Modified-Since` is only
+/// consulted when no `If-None-Match` is present.
+fn revalidated(
+    req: &actix_web::HttpRequest,
+    etag: &str,
+    modified: Option<std::time::SystemTime>,
+) -> bool {
+    if let Some(if_none_match) = req
+        .headers()
+        .get(http::header::IF_NONE_MATCH)
+        .and_then(|value| value.to_str().ok())
+    {
+        return if_none_match == "*"
+            || if_none_match
+                .split(',')
+                .any(|candidate| candidate.trim().trim_start_matches("W/") == etag);
+    }
+    if let (Some(modified), Some(since)) = (
+        modified,
+        req.headers()
+            .get(http::header::IF_MODIFIED_SINCE)
+            .and_then(|value| value.to_str().ok())
+            .and_then(|value| value.parse::<http::header::HttpDate>().ok()),
+    ) {
+        return std::time::SystemTime::from(since) >= modified;
+    }
+    false
+}
+
+macro_rules! some_or_404 {
+    ($res:expr) => {
+        match $res {
+            Some(val) => val,
+            None => {
+                return Ok(HttpResponse::NotFound()
+                    .insert_header(crate::cache_control_no_store())
+                    .body("missed hash"))
+            }
+        }
+    };
+}
+pub(crate) use some_or_404;
+
+#[derive(Debug)]
+struct ServerError {
+    err: anyhow::Error,
+}
+
+impl Display for ServerError {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        writeln!(f, "{}", self.err)?;
+        for cause in self.err.chain().skip(1) {
+            writeln!(f, "because: {}", cause)?;
+        }
+        Ok(())
+    }
+}
+
+impl actix_web::error::ResponseError for ServerError {}
+
+impl From<anyhow::Error> for ServerError {
+    fn from(err: anyhow::Error) -> ServerError {
+        ServerError { err }
+    }
+}
+
+type ServerResult = Result<HttpResponse, ServerError>;
+
+/// The full route table, shared between the server and the benchmark
+/// harness in `benches/`.
+pub fn configure_routes(cfg: &mut web::ServiceConfig) {
+    cfg.route("/", web::get().to(root::get))
+        .route("/{hash}.ls", web::get().to(narlist::get))
+        .route("/{hash}.ls", web::head().to(narlist::get))
+        .route("/{hash}.narinfo", web::get().to(narinfo::get))
+        .route("/{hash}.narinfo", web::head().to(narinfo::get))
+        .route("/narinfos", web::post().to(narinfo::post_batch))
+        .route(
+            &format!("/nar/{{narhash:[{0}]{{52}}}}.nar", NIXBASE32_ALPHABET),
+            web::get().to(nar::get),
+        )
+        .route(
+            &format!("/nar/{{narhash:[{0}]{{52}}}}.nar", NIXBASE32_ALPHABET),
+            web::head().to(nar::head),
+        )
+        .route(
+            &format!("/nar/{{narhash:[{0}]{{52}}}}.nar.zst", NIXBASE32_ALPHABET),
+            web::get().to(narcache::get),
+        )
+        .route(
+            &format!("/nar/{{narhash:[{0}]{{52}}}}.nar.zst", NIXBASE32_ALPHABET),
+            web::head().to(narcache::get),
+        )
+        .route(
+            // narinfos served by nix-serve have the narhash embedded in the nar URL.
+            // While we don't do that, if nix-serve is replaced with harmonia, the old nar URLs
+            // will stay in client caches for a while - so support them anyway.
+            &format!(
+                "/nar/{{outhash:[{0}]{{32}}}}-{{narhash:[{0}]{{52}}}}.nar",
+                NIXBASE32_ALPHABET
+            ),
+            web::get().to(nar::get),
+        )
+        .route(
+            &format!(
+                "/nar/{{outhash:[{0}]{{32}}}}-{{narhash:[{0}]{{52}}}}.nar",
+                NIXBASE32_ALPHABET
+            ),
+            web::head().to(nar::head),
+        )
+        // registered after the specific /nar routes: only URLs no local
+        // route serves (e.g. upstream .nar.xz names) end up here
+        .route("/nar/{rest:.*}", web::get().to(upstream::nar_fallback))
+        .route("/serve/{hash}{path:.*}", web::get().to(serve::get))
+        .route("/extract/{hash}", web::post().to(extract::post))
+        .route("/closure/{hash}", web::get().to(closure::get))
+        .route("/log/{drv}", web::get().to(buildlog::get))
+        .route("/warm", web::post().to(warming::post))
+        .route("/version", web::get().to(version::get))
+        .route("/health", web::get().to(health::get))
+        .route("/metrics", web::get().to(metrics::get))
+        .route("/nix-cache-info", web::get().to(cacheinfo::get));
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use actix_web::test::TestRequest;
+    use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+    #[test]
+    fn test_revalidated() {
+        let req = TestRequest::default()
+            .insert_header((http::header::IF_NONE_MATCH, "\"abc\""))
+            .to_http_request();
+        assert!(revalidated(&req, "\"abc\"", None));
+        assert!(!revalidated(&req, "\"def\"", None));
+
+        let req = TestRequest::default()
+            .insert_header((http::header::IF_NONE_MATCH, "W/\"abc\", \"def\""))
+            .to_http_request();
+        assert!(revalidated(&req, "\"def\"", None));
+
+        let modified = UNIX_EPOCH + Duration::from_secs(1_700_000_000);
+        let since = http::header::HttpDate::from(modified);
+        let req = TestRequest::default()
+            .insert_header((http::header::IF_MODIFIED_SINCE, since.to_string()))
+            .to_http_request();
+        assert!(revalidated(&req, "\"abc\"", Some(modified)));
+        assert!(!revalidated(
+            &req,
+            "\"abc\"",
+            Some(modified + Duration::from_secs(60))
+        ));
+        // If-None-Match wins over If-Modified-Since
+        let req = TestRequest::default()
+            .insert_header((http::header::IF_NONE_MATCH, "\"other\""))
+            .insert_header((http::header::IF_MODIFIED_SINCE, since.to_string()))
+            .to_http_request();
+        assert!(!revalidated(&req, "\"abc\"", Some(modified)));
+    }
+
+    #[test]
+    fn test_revalidated_ignored_without_validators() {
+        let req = TestRequest::default().to_http_request();
+        assert!(!revalidated(&req, "\"abc\"", Some(SystemTime::now())));
+    }
+}
+
+pub async fn inner_main() -> Result<()> {
+    env_logger::Builder::from_env(env_logger::Env::default().default_filter_or("info")).init();
+
+    let c = web::Data::new(config::load().with_context(|| "Failed to load configuration")?);
+    let config_data = c.clone();
+
+    // pre-warm before binding: signing keys and the hash index were already
+    // loaded by config::load, so handshaking the minimum daemon connections
+    // is what remains before the first request can be served at full speed
+    c.store.daemon_pool().prewarm(c.daemon_min_connections).await;
+    health::set_ready();
+
+    // SIGHUP re-reads the signing keys in place. Rotating keys through a
+    // restart would drop every in-flight NAR stream; a reload is a pointer
+    // swap the signing path picks up on its next request.
+    {
+        let c = c.clone();
+        tokio::task::spawn(async move {
+            use tokio::signal::unix::{signal, SignalKind};
+            let mut hangup = match signal(SignalKind::hangup()) {
+                Ok(hangup) => hangup,
+                Err(e) => {
+                    log::warn!("cannot listen for SIGHUP: {}", e);
+                    return;
+                }
+            };
+            while hangup.recv().await.is_some() {
+                match config::parse_signing_keys(&c.sign_key_paths) {
+                    Ok(keys) => {
+                        log::info!("SIGHUP: reloaded {} signing key(s)", keys.len());
+                        c.secret_keys.replace(keys);
+                        narinfo::invalidate_signature_cache();
+                    }
+                    Err(e) => log::warn!("SIGHUP: keeping previous signing keys: {:#}", e),
+                }
+            }
+        });
+    }
+
+    log::info!("listening on {}", c.bind);
+    let mut server = HttpServer::new(move || {
+        App::new()
+            .wrap_fn(|req, srv| {
+                use actix_web::dev::Service as _;
+                let start = std::time::Instant::now();
+                let fut = srv.call(req);
+                async move {
+                    let res = fut.await?;
+                    // label by the matched route pattern to keep cardinality bounded
+                    let route = res
+                        .request()
+                        .match_pattern()
+                        .unwrap_or_else(|| "unmatched".into());
+                    metrics::observe_http(&route, res.status().as_u16(), start.elapsed());
+                    Ok(res)
+                }
+            })
+            .wrap(middleware::Compress::default())
+            .app_data(config_data.clone())
+            .configure(configure_routes)
+    })
+    // default is 5 seconds, which is too small when doing mass requests on slow machines
+    .client_request_timeout(Duration::from_secs(30))
+    .workers(c.workers)
+    .max_connection_rate(c.max_connection_rate);
+
+    let try_url = Url::parse(&c.bind);
+    let (bind, uds) = {
+        if try_url.is_ok() {
+            let url = try_url.as_ref().unwrap();
+            if url.scheme() != "unix" {
+                (c.bind.as_str(), false)
+            } else if url.host().is_none() {
+                (url.path(), true)
+            } else {
+                bail!("Can only bind to file URLs without host portion.");
+            }
+        } else {
+            (c.bind.as_str(), false)
+        }
+    };
+
+    if c.tls_cert_path.is_some() || c.tls_key_path.is_some() {
+        if uds {
+            log::error!("TLS is not supported with Unix domain sockets.");
+            std::process::exit(1);
+        }
+        let mut builder = SslAcceptor::mozilla_intermediate(SslMethod::tls())?;
+        builder.set_private_key_file(c.tls_key_path.clone().unwrap(), SslFiletype::PEM)?;
+        builder.set_certificate_chain_file(c.tls_cert_path.clone().unwrap())?;
+        server = server.bind_openssl(c.bind.clone(), builder)?;
+    } else if uds {
+        if !cfg!(unix) {
+            log::error!("Binding to Unix domain sockets is only supported on Unix.");
+            std::process::exit(1);
+        } else {
+            let socket_path = Path::new(bind);
+            server = server.bind_uds(socket_path)?;
+            fs::set_permissions(socket_path, fs::Permissions::from_mode(0o777))?;
+        }
+    } else {
+        server = server.bind(c.bind.clone())?;
+    }
+
+    server.run().await.context("Failed to start server")
+}
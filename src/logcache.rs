@@ -0,0 +1,314 @@
+//! A disk-backed cache of build logs recompressed from bzip2 to zstd.
+//!
+//! Dashboards tail-poll the same logs over and over; running a fresh
+//! BzDecoder over a multi-hundred-MB `.drv.bz2` on every request burns CPU
+//! for nothing. A cache entry is `<drv>.zst` plus a `.info` sidecar with the
+//! decompressed size; as in the compressed-NAR cache the sidecar is written
+//! last and marks the entry as complete. Serving an entry decompresses zstd
+//! (cheap, unlike bzip2) and supports Range on the decompressed stream.
+
+use std::collections::HashSet;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+
+use actix_web::{http, web, HttpRequest, HttpResponse};
+use anyhow::{Context, Result};
+use async_compression::tokio::bufread::{BzDecoder, ZstdDecoder, ZstdEncoder};
+use async_compression::Level;
+use serde::{Deserialize, Serialize};
+use tokio::io::{AsyncReadExt, AsyncWriteExt, BufReader};
+use tokio::sync::Semaphore;
+use tokio_util::io::ReaderStream;
+
+use crate::config::Config;
+use crate::nar::HttpRange;
+use crate::{cache_control_max_age_1y, cache_control_no_store};
+
+#[derive(Debug, Serialize, Deserialize)]
+struct LogEntry {
+    /// decompressed size in bytes
+    size: u64,
+}
+
+#[derive(Debug)]
+pub(crate) struct LogCache {
+    dir: PathBuf,
+    level: i32,
+    jobs: Arc<Semaphore>,
+    in_flight: Mutex<HashSet<PathBuf>>,
+}
+
+impl LogCache {
+    pub(crate) fn new(dir: PathBuf, level: i32, jobs: usize) -> Self {
+        Self {
+            dir,
+            level,
+            jobs: Arc::new(Semaphore::new(jobs.max(1))),
+            in_flight: Mutex::new(HashSet::new()),
+        }
+    }
+
+    /// Cache file name for a log path: the two hashed path components of
+    /// `.../drvs/<xx>/<rest>.drv.bz2` joined back into one name.
+    fn key(log_path: &Path) -> Option<String> {
+        let name = log_path.file_name()?.to_str()?;
+        let prefix = log_path.parent()?.file_name()?.to_str()?;
+        Some(format!("{}{}", prefix, name.strip_suffix(".bz2").unwrap_or(name)))
+    }
+
+    fn log_file(&self, key: &str) -> PathBuf {
+        self.dir.join(format!("{}.zst", key))
+    }
+
+    fn info_file(&self, key: &str) -> PathBuf {
+        self.dir.join(format!("{}.zst.info", key))
+    }
+
+    /// Returns the cache file and decompressed size of a finished entry.
+    async fn lookup(&self, key: &str) -> Option<(PathBuf, u64)> {
+        let data = tokio::fs::read(self.info_file(key)).await.ok()?;
+        let entry: LogEntry = serde_json::from_slice(&data).ok()?;
+        Some((self.log_file(key), entry.size))
+    }
+
+    async fn recompress(&self, key: &str, log_path: &Path) -> Result<()> {
+        tokio::fs::create_dir_all(&self.dir)
+            .await
+            .with_context(|| format!("Failed to create cache dir: {}", self.dir.display()))?;
+        let tmp_path = self.dir.join(format!(".{}.{}.tmp", key, std::process::id()));
+        let res = self.recompress_to(&tmp_path, key, log_path).await;
+        if res.is_err() {
+            let _ = tokio::fs::remove_file(&tmp_path).await;
+        }
+        res
+    }
+
+    async fn recompress_to(&self, tmp_path: &Path, key: &str, log_path: &Path) -> Result<()> {
+        let file = tokio::fs::File::open(log_path)
+            .await
+            .with_context(|| format!("Failed to open build log: {}", log_path.display()))?;
+        // count the decompressed bytes between the two codecs for the sidecar
+        let mut decoder = BzDecoder::new(BufReader::new(file));
+        let mut size = 0u64;
+        let mut out = tokio::fs::File::create(tmp_path)
+            .await
+            .with_context(|| format!("Failed to create {}", tmp_path.display()))?;
+        let mut buf = vec![0u8; 64 * 1024];
+        let mut chunks = Vec::new();
+        loop {
+            let n = decoder
+                .read(&mut buf)
+                .await
+                .context("Failed to decompress build log")?;
+            if n == 0 {
+                break;
+            }
+            size += n as u64;
+            chunks.extend_from_slice(&buf[..n]);
+            // re-encode in batches so huge logs don't sit in memory whole
+            if chunks.len() >= 4 * 1024 * 1024 {
+                write_zstd(&mut out, &chunks, self.level, false).await?;
+                chunks.clear();
+            }
+        }
+        write_zstd(&mut out, &chunks, self.level, true).await?;
+        out.flush().await.context("Failed to flush")?;
+        drop(out);
+
+        tokio::fs::rename(tmp_path, self.log_file(key))
+            .await
+            .context("Failed to move recompressed log into place")?;
+        // the sidecar goes last: it marks the entry as complete
+        tokio::fs::write(
+            self.info_file(key),
+            serde_json::to_vec(&LogEntry { size })?,
+        )
+        .await
+        .context("Failed to write sidecar")?;
+        log::info!(
+            "recompressed build log {} ({} bytes decompressed)",
+            log_path.display(),
+            size
+        );
+        Ok(())
+    }
+}
+
+/// Writes one zstd frame holding `data`. Frame-per-batch keeps memory flat;
+/// the decoder below consumes concatenated frames transparently.
+async fn write_zstd(
+    out: &mut tokio::fs::File,
+    data: &[u8],
+    level: i32,
+    final_chunk: bool,
+) -> Result<()> {
+    if data.is_empty() && !final_chunk {
+        return Ok(());
+    }
+    let mut encoder = ZstdEncoder::with_quality(io::Cursor::new(data), Level::Precise(level));
+    let mut buf = vec![0u8; 64 * 1024];
+    loop {
+        let n = encoder
+            .read(&mut buf)
+            .await
+            .context("Failed to compress build log")?;
+        if n == 0 {
+            return Ok(());
+        }
+        out.write_all(&buf[..n])
+            .await
+            .context("Failed to write recompressed log")?;
+    }
+}
+
+/// Kicks off background recompression of a build log unless the entry
+/// already exists or is being produced, sharing the compression job
+/// semaphore so warming can't starve live traffic.
+fn spawn_recompress(settings: web::Data<Config>, key: String, log_path: PathBuf) {
+    let cache = match &settings.log_cache {
+        Some(cache) => cache,
+        None => return,
+    };
+    {
+        let cache_file = cache.log_file(&key);
+        let mut in_flight = cache.in_flight.lock().expect("in_flight lock poisoned");
+        if in_flight.contains(&cache_file) || cache.info_file(&key).exists() {
+            return;
+        }
+        in_flight.insert(cache_file);
+    }
+    tokio::task::spawn(async move {
+        let cache = settings.log_cache.as_ref().unwrap();
+        let _permit = cache
+            .jobs
+            .clone()
+            .acquire_owned()
+            .await
+            .expect("compression semaphore closed");
+        if let Err(e) = cache.recompress(&key, &log_path).await {
+            log::warn!("Failed to recompress {}: {:#}", log_path.display(), e);
+        }
+        cache
+            .in_flight
+            .lock()
+            .expect("in_flight lock poisoned")
+            .remove(&cache.log_file(&key));
+    });
+}
+
+/// Serves the decompressed log from the cache when a finished entry exists,
+/// with single-range support so tail-polling doesn't re-transfer from byte
+/// zero; otherwise starts recompression in the background and returns `None`
+/// so the caller can fall back to direct bunzip2 streaming.
+pub(crate) async fn try_serve(
+    settings: &web::Data<Config>,
+    log_path: &Path,
+    req: &HttpRequest,
+) -> Result<Option<HttpResponse>> {
+    let cache = match &settings.log_cache {
+        Some(cache) => cache,
+        None => return Ok(None),
+    };
+    let key = match LogCache::key(log_path) {
+        Some(key) => key,
+        None => return Ok(None),
+    };
+    let (cache_file, total) = match cache.lookup(&key).await {
+        Some(entry) => entry,
+        None => {
+            spawn_recompress(settings.clone(), key, log_path.to_owned());
+            return Ok(None);
+        }
+    };
+
+    let mut offset = 0;
+    let mut length = total;
+    let mut res = HttpResponse::Ok();
+    if let Some(ranges) = req.headers().get(http::header::RANGE) {
+        match ranges
+            .to_str()
+            .ok()
+            .and_then(|header| HttpRange::parse(header, total).ok())
+        {
+            Some(ranges) => {
+                offset = ranges[0].start;
+                length = ranges[0].length;
+                res.status(http::StatusCode::PARTIAL_CONTENT);
+                // don't let the compression middleware modify partial content
+                res.insert_header((
+                    http::header::CONTENT_ENCODING,
+                    http::header::HeaderValue::from_static("identity"),
+                ));
+                res.insert_header((
+                    http::header::CONTENT_RANGE,
+                    format!("bytes {}-{}/{}", offset, offset + length - 1, total),
+                ));
+            }
+            None => {
+                return Ok(Some(
+                    HttpResponse::RangeNotSatisfiable()
+                        .insert_header((http::header::CONTENT_RANGE, format!("bytes */{}", total)))
+                        .insert_header(cache_control_no_store())
+                        .finish(),
+                ))
+            }
+        }
+    }
+
+    let file = tokio::fs::File::open(&cache_file)
+        .await
+        .with_context(|| format!("Failed to open cached log: {}", cache_file.display()))?;
+    let mut decoder = ZstdDecoder::new(BufReader::new(file));
+    decoder.multiple_members(true);
+    // zstd is cheap to skip through, unlike re-running bzip2 from the start
+    if offset > 0 {
+        tokio::io::copy(&mut (&mut decoder).take(offset), &mut tokio::io::sink())
+            .await
+            .context("Failed to skip to range start")?;
+    }
+    let stream = ReaderStream::new(decoder.take(length));
+    Ok(Some(
+        res.insert_header(cache_control_max_age_1y())
+            .insert_header(http::header::ContentType(mime::TEXT_PLAIN_UTF_8))
+            .insert_header((http::header::ACCEPT_RANGES, "bytes"))
+            .body(actix_web::body::SizedStream::new(length, stream)),
+    ))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[tokio::test]
+    async fn test_log_cache_roundtrip_and_range() -> Result<()> {
+        let temp_dir = tempfile::tempdir().context("Failed to create temp dir")?;
+        let drv_dir = temp_dir.path().join("ab");
+        std::fs::create_dir(&drv_dir)?;
+        let log_path = drv_dir.join("cdef-test.drv.bz2");
+        let content: Vec<u8> = (0..300_000u32).map(|i| (i % 251) as u8).collect();
+        {
+            use bzip2::write::BzEncoder;
+            use std::io::Write;
+            let mut encoder =
+                BzEncoder::new(std::fs::File::create(&log_path)?, bzip2::Compression::fast());
+            encoder.write_all(&content)?;
+            encoder.finish()?;
+        }
+
+        let cache = LogCache::new(temp_dir.path().join("cache"), 3, 1);
+        let key = LogCache::key(&log_path).unwrap();
+        assert_eq!(key, "abcdef-test.drv");
+        cache.recompress(&key, &log_path).await?;
+        let (cache_file, size) = cache.lookup(&key).await.expect("entry not finished");
+        assert_eq!(size, content.len() as u64);
+
+        let file = tokio::fs::File::open(&cache_file).await?;
+        let mut decoder = ZstdDecoder::new(BufReader::new(file));
+        decoder.multiple_members(true);
+        let mut out = Vec::new();
+        decoder.read_to_end(&mut out).await?;
+        assert_eq!(out, content);
+        Ok(())
+    }
+}
@@ -0,0 +1,264 @@
+//! Prometheus exposition for `/metrics`.
+//!
+//! The exporter is hand-rolled: counters and histograms are plain atomics on
+//! the hot paths and only turned into text when scraped, so instrumentation
+//! stays dependency-free and cheap enough for per-chunk use.
+
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, LazyLock, RwLock};
+use std::time::Duration;
+
+use actix_web::{http, web, HttpResponse};
+
+use crate::config::Config;
+
+#[derive(Debug, Default)]
+pub(crate) struct Counter(AtomicU64);
+
+impl Counter {
+    const fn new() -> Self {
+        Self(AtomicU64::new(0))
+    }
+
+    pub(crate) fn inc(&self) {
+        self.add(1);
+    }
+
+    pub(crate) fn add(&self, n: u64) {
+        self.0.fetch_add(n, Ordering::Relaxed);
+    }
+
+    fn get(&self) -> u64 {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+/// A value that moves both ways, e.g. bytes currently buffered.
+#[derive(Debug, Default)]
+pub(crate) struct Gauge(AtomicU64);
+
+impl Gauge {
+    const fn new() -> Self {
+        Self(AtomicU64::new(0))
+    }
+
+    pub(crate) fn add(&self, n: u64) {
+        self.0.fetch_add(n, Ordering::Relaxed);
+    }
+
+    pub(crate) fn sub(&self, n: u64) {
+        self.0.fetch_sub(n, Ordering::Relaxed);
+    }
+
+    fn get(&self) -> u64 {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+/// Upper bucket bounds in seconds; `+Inf` is implicit.
+const BUCKETS: [f64; 10] = [
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.1, 0.5, 2.5, 10.0,
+];
+
+/// A latency histogram with fixed buckets. Each observation lands in exactly
+/// one bucket; the cumulative `le` counts Prometheus expects are computed at
+/// render time.
+#[derive(Debug)]
+pub(crate) struct Histogram {
+    buckets: [Counter; BUCKETS.len()],
+    count: Counter,
+    sum_micros: Counter,
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl Histogram {
+    const fn new() -> Self {
+        const ZERO: Counter = Counter::new();
+        Self {
+            buckets: [ZERO; BUCKETS.len()],
+            count: Counter::new(),
+            sum_micros: Counter::new(),
+        }
+    }
+
+    pub(crate) fn observe(&self, duration: Duration) {
+        let secs = duration.as_secs_f64();
+        if let Some(i) = BUCKETS.iter().position(|bound| secs <= *bound) {
+            self.buckets[i].inc();
+        }
+        self.count.inc();
+        self.sum_micros.add(duration.as_micros() as u64);
+    }
+
+    fn render(&self, out: &mut String, name: &str, labels: &str) {
+        let mut cumulative = 0;
+        for (bucket, bound) in self.buckets.iter().zip(BUCKETS) {
+            cumulative += bucket.get();
+            let _ = writeln!(out, "{name}_bucket{{{labels}le=\"{bound}\"}} {cumulative}");
+        }
+        let count = self.count.get();
+        let _ = writeln!(out, "{name}_bucket{{{labels}le=\"+Inf\"}} {count}");
+        let sum = self.sum_micros.get() as f64 / 1e6;
+        let _ = writeln!(out, "{name}_sum{{{labels}}} {sum}");
+        let _ = writeln!(out, "{name}_count{{{labels}}} {count}");
+    }
+}
+
+/// Time spent serving a daemon RPC, including the protocol round trip.
+pub(crate) static DAEMON_RPC_LATENCY: Histogram = Histogram::new();
+/// Time spent waiting for a free slot in the daemon connection pool.
+pub(crate) static DAEMON_POOL_WAIT: Histogram = Histogram::new();
+/// NAR payload bytes handed to response streams.
+pub(crate) static NAR_BYTES_SENT: Counter = Counter::new();
+/// Chunk sends that found the response channel full (client backpressure).
+pub(crate) static NAR_CHANNEL_FULL: Counter = Counter::new();
+/// NAR bytes currently sitting in streaming channels waiting for clients.
+pub(crate) static NAR_BUFFERED_BYTES: Gauge = Gauge::new();
+pub(crate) static METADATA_CACHE_HITS: Counter = Counter::new();
+pub(crate) static METADATA_CACHE_MISSES: Counter = Counter::new();
+
+#[derive(Debug, Default)]
+struct RouteMetrics {
+    /// responses by status class, 1xx through 5xx
+    responses: [Counter; 5],
+    latency: Histogram,
+}
+
+static HTTP_ROUTES: LazyLock<RwLock<HashMap<String, Arc<RouteMetrics>>>> =
+    LazyLock::new(Default::default);
+
+/// Records one served request; `route` is the matched route pattern so
+/// cardinality stays bounded by the route table, not by request paths.
+pub(crate) fn observe_http(route: &str, status: u16, duration: Duration) {
+    let metrics = HTTP_ROUTES
+        .read()
+        .expect("metrics lock poisoned")
+        .get(route)
+        .cloned();
+    let metrics = match metrics {
+        Some(metrics) => metrics,
+        None => HTTP_ROUTES
+            .write()
+            .expect("metrics lock poisoned")
+            .entry(route.to_owned())
+            .or_default()
+            .clone(),
+    };
+    let class = (status / 100).clamp(1, 5) as usize - 1;
+    metrics.responses[class].inc();
+    metrics.latency.observe(duration);
+}
+
+fn render(settings: &Config) -> String {
+    let mut out = String::with_capacity(8 * 1024);
+
+    out.push_str("# HELP harmonia_http_requests_total Served HTTP requests by route and status class.\n");
+    out.push_str("# TYPE harmonia_http_requests_total counter\n");
+    let routes = HTTP_ROUTES.read().expect("metrics lock poisoned");
+    for (route, metrics) in routes.iter() {
+        let route = route.replace('\\', "\\\\").replace('"', "\\\"");
+        for (class, counter) in metrics.responses.iter().enumerate() {
+            let count = counter.get();
+            if count > 0 {
+                let _ = writeln!(
+                    out,
+                    "harmonia_http_requests_total{{route=\"{}\",status=\"{}xx\"}} {}",
+                    route,
+                    class + 1,
+                    count
+                );
+            }
+        }
+    }
+    out.push_str("# HELP harmonia_http_request_duration_seconds Request latency by route.\n");
+    out.push_str("# TYPE harmonia_http_request_duration_seconds histogram\n");
+    for (route, metrics) in routes.iter() {
+        let route = route.replace('\\', "\\\\").replace('"', "\\\"");
+        metrics.latency.render(
+            &mut out,
+            "harmonia_http_request_duration_seconds",
+            &format!("route=\"{}\",", route),
+        );
+    }
+    drop(routes);
+
+    out.push_str("# HELP harmonia_daemon_rpc_duration_seconds nix-daemon RPC latency.\n");
+    out.push_str("# TYPE harmonia_daemon_rpc_duration_seconds histogram\n");
+    DAEMON_RPC_LATENCY.render(&mut out, "harmonia_daemon_rpc_duration_seconds", "");
+    out.push_str("# HELP harmonia_daemon_pool_wait_seconds Time waiting for a pooled daemon connection.\n");
+    out.push_str("# TYPE harmonia_daemon_pool_wait_seconds histogram\n");
+    DAEMON_POOL_WAIT.render(&mut out, "harmonia_daemon_pool_wait_seconds", "");
+    let pool = settings.store.daemon_pool();
+    out.push_str("# HELP harmonia_daemon_connections_in_use Daemon connections currently checked out.\n");
+    out.push_str("# TYPE harmonia_daemon_connections_in_use gauge\n");
+    let _ = writeln!(out, "harmonia_daemon_connections_in_use {}", pool.in_use());
+    out.push_str("# HELP harmonia_daemon_connections_idle Daemon connections parked in the pool.\n");
+    out.push_str("# TYPE harmonia_daemon_connections_idle gauge\n");
+    let _ = writeln!(out, "harmonia_daemon_connections_idle {}", pool.idle());
+
+    out.push_str("# HELP harmonia_nar_bytes_sent_total NAR payload bytes handed to response streams.\n");
+    out.push_str("# TYPE harmonia_nar_bytes_sent_total counter\n");
+    let _ = writeln!(out, "harmonia_nar_bytes_sent_total {}", NAR_BYTES_SENT.get());
+    out.push_str("# HELP harmonia_nar_channel_full_total NAR chunk sends that hit a full response channel.\n");
+    out.push_str("# TYPE harmonia_nar_channel_full_total counter\n");
+    let _ = writeln!(out, "harmonia_nar_channel_full_total {}", NAR_CHANNEL_FULL.get());
+    out.push_str("# HELP harmonia_nar_buffered_bytes NAR bytes buffered in streaming channels.\n");
+    out.push_str("# TYPE harmonia_nar_buffered_bytes gauge\n");
+    let _ = writeln!(out, "harmonia_nar_buffered_bytes {}", NAR_BUFFERED_BYTES.get());
+
+    out.push_str("# HELP harmonia_metadata_cache_hits_total Metadata lookups answered from the in-process cache.\n");
+    out.push_str("# TYPE harmonia_metadata_cache_hits_total counter\n");
+    let _ = writeln!(
+        out,
+        "harmonia_metadata_cache_hits_total {}",
+        METADATA_CACHE_HITS.get()
+    );
+    out.push_str("# HELP harmonia_metadata_cache_misses_total Metadata lookups that went to the backend.\n");
+    out.push_str("# TYPE harmonia_metadata_cache_misses_total counter\n");
+    let _ = writeln!(
+        out,
+        "harmonia_metadata_cache_misses_total {}",
+        METADATA_CACHE_MISSES.get()
+    );
+
+    out
+}
+
+pub(crate) async fn get(settings: web::Data<Config>) -> HttpResponse {
+    HttpResponse::Ok()
+        .insert_header((
+            http::header::CONTENT_TYPE,
+            "text/plain; version=0.0.4; charset=utf-8",
+        ))
+        .insert_header(crate::cache_control_no_store())
+        .body(render(&settings))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_histogram_render() {
+        let histogram = Histogram::new();
+        histogram.observe(Duration::from_micros(700));
+        histogram.observe(Duration::from_millis(3));
+        histogram.observe(Duration::from_secs(60));
+
+        let mut out = String::new();
+        histogram.render(&mut out, "x", "");
+        assert!(out.contains("x_bucket{le=\"0.001\"} 1"), "{out}");
+        // cumulative: the 3ms sample falls in the 0.005 bucket
+        assert!(out.contains("x_bucket{le=\"0.005\"} 2"), "{out}");
+        assert!(out.contains("x_bucket{le=\"10\"} 2"), "{out}");
+        assert!(out.contains("x_bucket{le=\"+Inf\"} 3"), "{out}");
+        assert!(out.contains("x_count{} 3"), "{out}");
+    }
+}
@@ -0,0 +1,236 @@
+use std::collections::HashSet;
+use std::error::Error;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+
+use actix_files::NamedFile;
+use actix_web::web::Bytes;
+use actix_web::{web, HttpRequest, HttpResponse, Responder};
+use anyhow::{bail, Context, Result};
+use async_compression::tokio::bufread::ZstdEncoder;
+use async_compression::Level;
+use serde::{Deserialize, Serialize};
+use tokio::io::AsyncReadExt;
+use tokio::io::AsyncWriteExt;
+use tokio::sync::Semaphore;
+use tokio_stream::StreamExt;
+use tokio_util::io::StreamReader;
+
+use crate::config::Config;
+use crate::nar::{dump_path_windowed, AccountedStream, NarSink, ThreadSafeError};
+use crate::signing::Sha256;
+use crate::{cache_control_max_age_1y, cache_control_no_store};
+
+/// Sidecar metadata for a compressed NAR, advertised in the narinfo.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub(crate) struct CompressedNar {
+    /// `sha256:<nix32>` of the compressed file.
+    pub(crate) file_hash: String,
+    pub(crate) file_size: u64,
+}
+
+/// A disk-backed cache of zstd-compressed NARs, keyed by nar hash.
+///
+/// Entries are populated in the background on first narinfo request with a
+/// bounded number of concurrent compression jobs. A finished entry consists
+/// of `<narhash>.nar.zst` plus a `.info` sidecar with the hash and size of
+/// the compressed file; the sidecar is written last, so its presence marks
+/// the entry as complete.
+#[derive(Debug)]
+pub(crate) struct NarCache {
+    dir: PathBuf,
+    level: i32,
+    jobs: Arc<Semaphore>,
+    in_flight: Mutex<HashSet<String>>,
+}
+
+impl NarCache {
+    pub(crate) fn new(dir: PathBuf, level: i32, jobs: usize) -> Self {
+        Self {
+            dir,
+            level,
+            jobs: Arc::new(Semaphore::new(jobs.max(1))),
+            in_flight: Mutex::new(HashSet::new()),
+        }
+    }
+
+    fn nar_path(&self, narhash: &str) -> PathBuf {
+        self.dir.join(format!("{}.nar.zst", narhash))
+    }
+
+    fn info_path(&self, narhash: &str) -> PathBuf {
+        self.dir.join(format!("{}.nar.zst.info", narhash))
+    }
+
+    /// Returns the metadata of a finished cache entry, if any.
+    pub(crate) async fn lookup(&self, narhash: &str) -> Option<CompressedNar> {
+        let data = tokio::fs::read(self.info_path(narhash)).await.ok()?;
+        serde_json::from_slice(&data).ok()
+    }
+
+    async fn compress(&self, narhash: &str, store_path: &Path, nar_size: u64) -> Result<()> {
+        tokio::fs::create_dir_all(&self.dir)
+            .await
+            .with_context(|| format!("Failed to create cache dir: {}", self.dir.display()))?;
+        let tmp_path = self
+            .dir
+            .join(format!(".{}.{}.tmp", narhash, std::process::id()));
+        let res = self
+            .compress_to(&tmp_path, narhash, store_path, nar_size)
+            .await;
+        if res.is_err() {
+            let _ = tokio::fs::remove_file(&tmp_path).await;
+        }
+        res
+    }
+
+    async fn compress_to(
+        &self,
+        tmp_path: &Path,
+        narhash: &str,
+        store_path: &Path,
+        nar_size: u64,
+    ) -> Result<()> {
+        let (tx, rx) = tokio::sync::mpsc::channel::<Result<Bytes, ThreadSafeError>>(64);
+        tokio::task::spawn(dump_path_windowed(store_path.to_owned(), NarSink::full(tx)));
+
+        // count the uncompressed bytes so a failed dump (the producer only
+        // closes the channel) can't end up as a truncated cache entry
+        let dumped = Arc::new(AtomicU64::new(0));
+        let counter = dumped.clone();
+        let stream = AccountedStream::new(rx).map(move |chunk| {
+            chunk
+                .map(|data| {
+                    counter.fetch_add(data.len() as u64, Ordering::Relaxed);
+                    data
+                })
+                .map_err(io::Error::other)
+        });
+        let mut encoder = ZstdEncoder::with_quality(
+            StreamReader::new(stream),
+            Level::Precise(self.level),
+        );
+
+        let mut out = tokio::fs::File::create(tmp_path)
+            .await
+            .with_context(|| format!("Failed to create {}", tmp_path.display()))?;
+        let mut hash = Sha256::new();
+        let mut file_size = 0u64;
+        let mut buf = vec![0u8; 64 * 1024];
+        loop {
+            let n = encoder
+                .read(&mut buf)
+                .await
+                .context("Failed to compress NAR")?;
+            if n == 0 {
+                break;
+            }
+            hash.update(&buf[..n]);
+            out.write_all(&buf[..n])
+                .await
+                .with_context(|| format!("Failed to write {}", tmp_path.display()))?;
+            file_size += n as u64;
+        }
+        out.flush().await.context("Failed to flush")?;
+        drop(out);
+
+        if dumped.load(Ordering::Relaxed) != nar_size {
+            bail!(
+                "Dump of {} produced {} bytes, expected {}",
+                store_path.display(),
+                dumped.load(Ordering::Relaxed),
+                nar_size
+            );
+        }
+
+        let entry = CompressedNar {
+            file_hash: format!("sha256:{}", hash.finish_nix32()),
+            file_size,
+        };
+        tokio::fs::rename(tmp_path, self.nar_path(narhash))
+            .await
+            .context("Failed to move compressed NAR into place")?;
+        // the sidecar goes last: it marks the entry as complete
+        tokio::fs::write(self.info_path(narhash), serde_json::to_vec(&entry)?)
+            .await
+            .context("Failed to write sidecar")?;
+        log::info!(
+            "compressed {} ({} -> {} bytes)",
+            store_path.display(),
+            nar_size,
+            entry.file_size
+        );
+        Ok(())
+    }
+}
+
+/// Kicks off background compression of a store path unless the entry already
+/// exists or is being produced. Jobs are throttled by the cache's semaphore
+/// so warming can't starve live traffic.
+pub(crate) fn spawn_compress(
+    settings: web::Data<Config>,
+    narhash: String,
+    store_path: PathBuf,
+    nar_size: u64,
+) {
+    let cache = match &settings.nar_cache {
+        Some(cache) => cache,
+        None => return,
+    };
+    {
+        let mut in_flight = cache.in_flight.lock().expect("in_flight lock poisoned");
+        if in_flight.contains(&narhash) || cache.info_path(&narhash).exists() {
+            return;
+        }
+        in_flight.insert(narhash.clone());
+    }
+    tokio::task::spawn(async move {
+        let cache = settings.nar_cache.as_ref().unwrap();
+        let _permit = cache
+            .jobs
+            .clone()
+            .acquire_owned()
+            .await
+            .expect("compression semaphore closed");
+        if let Err(e) = cache.compress(&narhash, &store_path, nar_size).await {
+            log::warn!("Failed to compress {}: {:#}", store_path.display(), e);
+        }
+        cache
+            .in_flight
+            .lock()
+            .expect("in_flight lock poisoned")
+            .remove(&narhash);
+    });
+}
+
+/// Serves `<narhash>.nar.zst` straight from the cache directory. NamedFile
+/// gives us Range and HEAD support for free.
+pub(crate) async fn get(
+    path: web::Path<String>,
+    req: HttpRequest,
+    settings: web::Data<Config>,
+) -> Result<HttpResponse, Box<dyn Error>> {
+    let cache = match &settings.nar_cache {
+        Some(cache) => cache,
+        None => {
+            return Ok(HttpResponse::NotFound()
+                .insert_header(cache_control_no_store())
+                .body("compressed nar cache not configured"))
+        }
+    };
+    let narhash = path.into_inner();
+    // only serve finished entries
+    if cache.lookup(&narhash).await.is_none() {
+        return Ok(HttpResponse::NotFound()
+            .insert_header(cache_control_no_store())
+            .body("not cached"));
+    }
+    let file = NamedFile::open_async(cache.nar_path(&narhash))
+        .await
+        .with_context(|| format!("Failed to open cached NAR for {}", narhash))?
+        .customize()
+        .insert_header(cache_control_max_age_1y());
+    Ok(file.respond_to(&req).map_into_boxed_body())
+}
@@ -1,14 +1,18 @@
+use std::sync::LazyLock;
+use std::time::Duration;
 use std::{error::Error, path::Path};
 
-use actix_web::{http, web, HttpResponse};
+use actix_web::{http, web, HttpRequest, HttpResponse};
 use anyhow::Context;
 use anyhow::Result;
 use serde::{Deserialize, Serialize};
 
+use crate::cache::Cache;
 use crate::config::{Config, SigningKey};
+use crate::daemon::ValidPathInfo;
 use crate::signing::convert_base16_to_nix32;
 use crate::signing::{fingerprint_path, sign_string};
-use crate::{cache_control_max_age_1d, nixhash, some_or_404};
+use crate::{cache_control_max_age_1d, nixhash};
 
 #[derive(Debug, Deserialize)]
 pub struct Param {
@@ -16,16 +20,23 @@ pub struct Param {
 }
 
 #[derive(Debug, Serialize)]
-struct NarInfo {
+pub(crate) struct NarInfo {
     store_path: String,
     url: String,
     compression: String,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    file_hash: Option<String>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    file_size: Option<u64>,
     nar_hash: String,
     nar_size: u64,
     references: Vec<String>,
     deriver: Option<String>,
     sigs: Vec<String>,
     ca: Option<String>,
+    /// Seconds since the epoch; only used for the Last-Modified header.
+    #[serde(skip)]
+    registration_time: u64,
 }
 
 fn extract_filename(path: &str) -> Option<String> {
@@ -34,33 +45,37 @@ fn extract_filename(path: &str) -> Option<String> {
         .and_then(|v| v.to_str().map(ToOwned::to_owned))
 }
 
-async fn query_narinfo(
+pub(crate) async fn query_narinfo(
     virtual_nix_store: &str,
     store_path: &str,
     hash: &str,
-    sign_keys: &Vec<SigningKey>,
+    sign_keys: &[SigningKey],
     settings: &web::Data<Config>,
 ) -> Result<Option<NarInfo>> {
-    let path_info = match settings
-        .store
-        .daemon
-        .lock()
-        .await
-        .query_path_info(store_path)
-        .await?
-        .path
-    {
+    let path_info = match settings.store.query_path_info(store_path).await? {
         Some(info) => info,
         None => {
             return Ok(None);
         }
     };
+    narinfo_from_path_info(virtual_nix_store, store_path, hash, path_info, sign_keys).map(Some)
+}
+
+fn narinfo_from_path_info(
+    virtual_nix_store: &str,
+    store_path: &str,
+    hash: &str,
+    path_info: ValidPathInfo,
+    sign_keys: &[SigningKey],
+) -> Result<NarInfo> {
     let nar_hash =
         convert_base16_to_nix32(&path_info.hash).context("failed to convert path info hash")?;
     let mut res = NarInfo {
         store_path: store_path.into(),
         url: format!("nar/{}.nar?hash={}", nar_hash, hash),
         compression: "none".into(),
+        file_hash: None,
+        file_size: None,
         nar_hash: format!("sha256:{}", nar_hash),
         nar_size: path_info.nar_size,
         references: vec![],
@@ -71,6 +86,7 @@ async fn query_narinfo(
         },
         sigs: vec![],
         ca: path_info.content_address,
+        registration_time: path_info.registration_time,
     };
 
     let refs = path_info.references.clone();
@@ -89,9 +105,9 @@ async fn query_narinfo(
         res.nar_size,
         &refs,
     )?;
-    for sk in sign_keys {
-        if let Some(ref fp) = fingerprint {
-            res.sigs.push(sign_string(sk, fp));
+    if let Some(fp) = fingerprint {
+        if !sign_keys.is_empty() {
+            res.sigs = sign_fingerprint(&fp, sign_keys);
         }
     }
 
@@ -99,52 +115,197 @@ async fn query_narinfo(
         res.sigs.clone_from(&path_info.sigs);
     }
 
-    Ok(Some(res))
+    Ok(res)
+}
+
+/// Signatures by fingerprint. A path's fingerprint never changes, so ed25519
+/// signing (the hottest CPU in the narinfo path under mass Hydra probing) only
+/// has to run once per path per key set; the TTL merely bounds staleness
+/// after a key rotation and restart.
+static SIGNATURE_CACHE: LazyLock<Cache<String, Vec<String>>> =
+    LazyLock::new(|| Cache::new(32 * 1024));
+
+const SIGNATURE_CACHE_TTL: Duration = Duration::from_secs(24 * 60 * 60);
+
+/// Drops all cached signatures; must run when the signing keys are swapped
+/// at runtime, or narinfos would keep serving signatures from retired keys
+/// for up to the cache TTL.
+pub(crate) fn invalidate_signature_cache() {
+    SIGNATURE_CACHE.clear();
+}
+
+fn sign_fingerprint(fingerprint: &str, sign_keys: &[SigningKey]) -> Vec<String> {
+    if let Some(sigs) = SIGNATURE_CACHE.get(&fingerprint.to_owned()) {
+        return sigs;
+    }
+    let sigs: Vec<String> = sign_keys
+        .iter()
+        .map(|sk| sign_string(sk, fingerprint))
+        .collect();
+    SIGNATURE_CACHE.insert(fingerprint.to_owned(), sigs.clone(), SIGNATURE_CACHE_TTL);
+    sigs
+}
+
+/// Advertises the compressed variant when the cache has a finished entry.
+/// Otherwise, when `populate` is set, kicks off background compression;
+/// batch lookups only check so resolving a big closure doesn't queue
+/// thousands of jobs at once.
+pub(crate) async fn apply_compression(
+    settings: &web::Data<Config>,
+    narinfo: &mut NarInfo,
+    populate: bool,
+) {
+    let cache = match &settings.nar_cache {
+        Some(cache) => cache,
+        None => return,
+    };
+    let narhash = narinfo
+        .nar_hash
+        .strip_prefix("sha256:")
+        .unwrap_or(&narinfo.nar_hash)
+        .to_owned();
+    match cache.lookup(&narhash).await {
+        Some(entry) => {
+            narinfo.url = format!("nar/{}.nar.zst", narhash);
+            narinfo.compression = "zstd".into();
+            narinfo.file_hash = Some(entry.file_hash);
+            narinfo.file_size = Some(entry.file_size);
+        }
+        None if populate => {
+            let store_path = settings.store.get_real_path(Path::new(&narinfo.store_path));
+            crate::narcache::spawn_compress(
+                settings.clone(),
+                narhash,
+                store_path,
+                narinfo.nar_size,
+            );
+        }
+        None => {}
+    }
 }
 
+/// Renders the text representation into a single pre-sized buffer; the old
+/// `Vec<String>` + join version allocated once per line, which showed up
+/// under mass Hydra probing.
 fn format_narinfo_txt(narinfo: &NarInfo) -> String {
-    let mut res = vec![
-        format!("StorePath: {}", narinfo.store_path),
-        format!("URL: {}", narinfo.url),
-        format!("Compression: {}", narinfo.compression),
-        format!("FileHash: {}", narinfo.nar_hash),
-        format!("FileSize: {}", narinfo.nar_size),
-        format!("NarHash: {}", narinfo.nar_hash),
-        format!("NarSize: {}", narinfo.nar_size),
-    ];
+    use std::fmt::Write;
+
+    let mut size = narinfo.store_path.len() + narinfo.url.len() + 2 * narinfo.nar_hash.len();
+    size += narinfo.references.iter().map(|r| r.len() + 1).sum::<usize>();
+    size += narinfo.sigs.iter().map(|s| s.len()).sum::<usize>();
+    // field names, numbers, optional lines and newlines
+    size += 256;
+
+    let mut res = String::with_capacity(size);
+    let _ = writeln!(res, "StorePath: {}", narinfo.store_path);
+    let _ = writeln!(res, "URL: {}", narinfo.url);
+    let _ = writeln!(res, "Compression: {}", narinfo.compression);
+    let _ = writeln!(
+        res,
+        "FileHash: {}",
+        narinfo.file_hash.as_ref().unwrap_or(&narinfo.nar_hash)
+    );
+    let _ = writeln!(
+        res,
+        "FileSize: {}",
+        narinfo.file_size.unwrap_or(narinfo.nar_size)
+    );
+    let _ = writeln!(res, "NarHash: {}", narinfo.nar_hash);
+    let _ = writeln!(res, "NarSize: {}", narinfo.nar_size);
 
     if !narinfo.references.is_empty() {
-        res.push(format!("References: {}", &narinfo.references.join(" ")));
+        res.push_str("References:");
+        for r in &narinfo.references {
+            res.push(' ');
+            res.push_str(r);
+        }
+        res.push('\n');
     }
 
     if let Some(drv) = &narinfo.deriver {
-        res.push(format!("Deriver: {}", drv));
+        let _ = writeln!(res, "Deriver: {}", drv);
     }
 
     for sig in &narinfo.sigs {
-        res.push(format!("Sig: {}", sig));
+        let _ = writeln!(res, "Sig: {}", sig);
     }
 
     if let Some(ca) = &narinfo.ca {
-        res.push(format!("CA: {}", ca));
+        let _ = writeln!(res, "CA: {}", ca);
+    }
+
+    res
+}
+
+/// The largest number of hash parts accepted by a single batch request.
+const MAX_BATCH_SIZE: usize = 4096;
+
+/// Bulk variant of `get`: takes a JSON array of hash parts and returns a JSON
+/// array of narinfos (or null per miss) in the same order, resolved with
+/// pipelined daemon queries instead of one round trip per path.
+pub(crate) async fn post_batch(
+    hashes: web::Json<Vec<String>>,
+    settings: web::Data<Config>,
+) -> Result<HttpResponse, Box<dyn Error>> {
+    let hashes = hashes.into_inner();
+    if hashes.len() > MAX_BATCH_SIZE {
+        return Ok(HttpResponse::BadRequest()
+            .body(format!("too many hashes, maximum is {}", MAX_BATCH_SIZE)));
+    }
+    if hashes.iter().any(|hash| hash.len() != 32) {
+        return Ok(HttpResponse::BadRequest().body("hashes must be 32 characters long"));
     }
 
-    res.push("".into());
-    res.join("\n")
+    let path_infos = settings
+        .store
+        .query_path_infos_from_hash_parts(&hashes)
+        .await?;
+    let sign_keys = settings.secret_keys.get();
+    let mut res = Vec::with_capacity(hashes.len());
+    for (hash, entry) in hashes.iter().zip(path_infos) {
+        res.push(match entry {
+            Some((store_path, path_info)) => {
+                let mut narinfo = narinfo_from_path_info(
+                    settings.store.virtual_store(),
+                    &store_path,
+                    hash,
+                    path_info,
+                    &sign_keys,
+                )?;
+                apply_compression(&settings, &mut narinfo, false).await;
+                Some(narinfo)
+            }
+            None => None,
+        });
+    }
+    Ok(HttpResponse::Ok().json(res))
 }
 
 pub(crate) async fn get(
     hash: web::Path<String>,
     param: web::Query<Param>,
+    req: HttpRequest,
     settings: web::Data<Config>,
 ) -> Result<HttpResponse, Box<dyn Error>> {
     let hash = hash.into_inner();
-    let store_path = some_or_404!(nixhash(&settings, &hash).await);
-    let narinfo = match query_narinfo(
+    let store_path = match nixhash(&settings, &hash).await {
+        Some(store_path) => store_path,
+        None => {
+            // not ours; maybe a configured upstream has it
+            if let Some(res) = crate::upstream::proxy(&settings, &format!("{}.narinfo", hash)).await
+            {
+                return Ok(res);
+            }
+            return Ok(HttpResponse::NotFound()
+                .insert_header(crate::cache_control_no_store())
+                .body("missed hash"));
+        }
+    };
+    let mut narinfo = match query_narinfo(
         settings.store.virtual_store(),
         &store_path,
         &hash,
-        &settings.secret_keys,
+        &settings.secret_keys.get(),
         &settings,
     )
     .await?
@@ -156,9 +317,28 @@ pub(crate) async fn get(
                 .body("missed hash"))
         }
     };
+    apply_compression(&settings, &mut narinfo, true).await;
+
+    // the nar hash pins the full narinfo content except the advertised
+    // compression, which flips once a background compression job finishes
+    let etag = format!(
+        "\"{}-{}\"",
+        narinfo.nar_hash.trim_start_matches("sha256:"),
+        narinfo.compression
+    );
+    let modified =
+        std::time::UNIX_EPOCH + std::time::Duration::from_secs(narinfo.registration_time);
+    if crate::revalidated(&req, &etag, Some(modified)) {
+        return Ok(HttpResponse::NotModified()
+            .insert_header((http::header::ETAG, etag))
+            .insert_header(cache_control_max_age_1d())
+            .finish());
+    }
 
     if param.json.is_some() {
         Ok(HttpResponse::Ok()
+            .insert_header((http::header::ETAG, etag))
+            .insert_header(http::header::LastModified(modified.into()))
             .insert_header(cache_control_max_age_1d())
             .json(narinfo))
     } else {
@@ -166,6 +346,8 @@ pub(crate) async fn get(
         Ok(HttpResponse::Ok()
             .insert_header((http::header::CONTENT_TYPE, "text/x-nix-narinfo"))
             .insert_header(("Nix-Link", narinfo.url))
+            .insert_header((http::header::ETAG, etag))
+            .insert_header(http::header::LastModified(modified.into()))
             .insert_header(cache_control_max_age_1d())
             .body(res))
     }
@@ -0,0 +1,170 @@
+//! Persistent hash-part index for instant path resolution.
+//!
+//! Every URL harmonia serves starts by resolving a 32-char hash part to a
+//! store path. The index keeps hash part -> store basename in one in-process
+//! map shared by all workers, persisted as a line-per-basename file so it
+//! survives restarts and skips the post-deploy window where every lookup is
+//! a cold daemon RPC. A background scan of the store directory fills and
+//! compacts it; entries are stat-verified by the caller before being
+//! trusted, so paths deleted by the garbage collector just fall back to the
+//! regular lookup path.
+
+use std::collections::HashMap;
+use std::io::Write;
+use std::path::PathBuf;
+use std::sync::{Arc, Mutex, RwLock};
+
+use anyhow::{Context, Result};
+
+#[derive(Debug)]
+pub(crate) struct PathIndex {
+    path: PathBuf,
+    /// hash part -> store basename
+    map: RwLock<HashMap<String, String>>,
+    /// append handle for incremental persistence
+    file: Mutex<Option<std::fs::File>>,
+}
+
+fn append_handle(path: &PathBuf) -> Result<std::fs::File> {
+    std::fs::OpenOptions::new()
+        .create(true)
+        .append(true)
+        .open(path)
+        .with_context(|| format!("Failed to open hash index: {}", path.display()))
+}
+
+impl PathIndex {
+    /// Loads the index file (missing is fine: the scan will build it).
+    pub(crate) fn load(path: PathBuf) -> Result<Self> {
+        let mut map = HashMap::new();
+        if let Ok(data) = std::fs::read_to_string(&path) {
+            for basename in data.lines() {
+                if basename.len() >= 32 {
+                    map.insert(basename[..32].to_owned(), basename.to_owned());
+                }
+            }
+        }
+        let file = append_handle(&path)?;
+        log::info!("loaded {} hash index entries from {}", map.len(), path.display());
+        Ok(Self {
+            path,
+            map: RwLock::new(map),
+            file: Mutex::new(Some(file)),
+        })
+    }
+
+    pub(crate) fn lookup(&self, hash_part: &str) -> Option<String> {
+        self.map
+            .read()
+            .expect("hash index lock poisoned")
+            .get(hash_part)
+            .cloned()
+    }
+
+    /// Drops an entry that turned out to be stale (e.g. garbage collected).
+    /// Not persisted: the next scan compacts the file.
+    pub(crate) fn forget(&self, hash_part: &str) {
+        self.map
+            .write()
+            .expect("hash index lock poisoned")
+            .remove(hash_part);
+    }
+
+    /// Records a resolved store basename, appending it to the index file if
+    /// it is new.
+    pub(crate) fn record(&self, basename: &str) {
+        if basename.len() < 32 {
+            return;
+        }
+        let new = self
+            .map
+            .write()
+            .expect("hash index lock poisoned")
+            .insert(basename[..32].to_owned(), basename.to_owned())
+            .is_none();
+        if new {
+            let mut file = self.file.lock().expect("hash index lock poisoned");
+            if let Some(file) = file.as_mut() {
+                if let Err(e) = writeln!(file, "{}", basename) {
+                    log::warn!("Failed to append to hash index: {}", e);
+                }
+            }
+        }
+    }
+
+    /// Scans the store directory, merges everything found into the map and
+    /// rewrites the index file from the result, dropping entries for paths
+    /// that no longer exist.
+    pub(crate) async fn scan(self: Arc<Self>, store_dir: PathBuf) -> Result<()> {
+        let mut read_dir = tokio::fs::read_dir(&store_dir)
+            .await
+            .with_context(|| format!("Failed to read store dir: {}", store_dir.display()))?;
+        let mut scanned = HashMap::new();
+        while let Some(entry) = read_dir.next_entry().await.context("Failed to read store dir")? {
+            if let Some(basename) = entry.file_name().to_str() {
+                if basename.len() >= 32 && !basename.starts_with('.') {
+                    scanned.insert(basename[..32].to_owned(), basename.to_owned());
+                }
+            }
+        }
+        log::info!(
+            "hash index scan of {} found {} paths",
+            store_dir.display(),
+            scanned.len()
+        );
+
+        let contents: String = {
+            let mut map = self.map.write().expect("hash index lock poisoned");
+            *map = scanned;
+            map.values().fold(String::new(), |mut acc, basename| {
+                acc.push_str(basename);
+                acc.push('\n');
+                acc
+            })
+        };
+        // compact: rewrite atomically, then swap the append handle
+        let tmp_path = self.path.with_extension("tmp");
+        tokio::fs::write(&tmp_path, contents)
+            .await
+            .with_context(|| format!("Failed to write {}", tmp_path.display()))?;
+        tokio::fs::rename(&tmp_path, &self.path)
+            .await
+            .context("Failed to move hash index into place")?;
+        let file = append_handle(&self.path)?;
+        *self.file.lock().expect("hash index lock poisoned") = Some(file);
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[tokio::test]
+    async fn test_index_persistence_and_scan() -> Result<()> {
+        let temp_dir = tempfile::tempdir().context("Failed to create temp dir")?;
+        let index_path = temp_dir.path().join("index");
+        let store = temp_dir.path().join("store");
+        std::fs::create_dir(&store)?;
+        let name_a = format!("{}-pkg-a", "a".repeat(32));
+        let name_b = format!("{}-pkg-b", "b".repeat(32));
+        std::fs::create_dir(store.join(&name_a))?;
+
+        let index = PathIndex::load(index_path.clone())?;
+        index.record(&name_b);
+        assert_eq!(index.lookup(&"b".repeat(32)), Some(name_b.clone()));
+
+        // appended entries survive a reload
+        let index = Arc::new(PathIndex::load(index_path.clone())?);
+        assert_eq!(index.lookup(&"b".repeat(32)), Some(name_b.clone()));
+
+        // the scan adds what's on disk and compacts away what is not
+        index.clone().scan(store).await?;
+        assert_eq!(index.lookup(&"a".repeat(32)), Some(name_a.clone()));
+        assert_eq!(index.lookup(&"b".repeat(32)), None);
+        let index = PathIndex::load(index_path)?;
+        assert_eq!(index.lookup(&"a".repeat(32)), Some(name_a));
+        assert_eq!(index.lookup(&"b".repeat(32)), None);
+        Ok(())
+    }
+}
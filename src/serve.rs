@@ -1,15 +1,19 @@
 use std::path::{Path, PathBuf};
+use std::sync::LazyLock;
+use std::time::Duration;
 
 use actix_files::NamedFile;
+use actix_web::web::Bytes;
 use actix_web::Responder;
-use actix_web::{web, HttpRequest, HttpResponse};
+use actix_web::{http, web, HttpRequest, HttpResponse};
 use anyhow::Context;
 use askama_escape::{escape as escape_html_entity, Html};
-use percent_encoding::{utf8_percent_encode, CONTROLS};
+use percent_encoding::{utf8_percent_encode, CONTROLS, NON_ALPHANUMERIC};
 use std::fmt::Write;
 
 use crate::{
-    config::Config, nixhash, some_or_404, ServerResult, BOOTSTRAP_SOURCE, CARGO_NAME, CARGO_VERSION,
+    cache::Cache, config::Config, nixhash, some_or_404, ServerResult, BOOTSTRAP_SOURCE, CARGO_NAME,
+    CARGO_VERSION,
 };
 
 /// Returns percent encoded file URL path.
@@ -48,48 +52,57 @@ fn file_size(bytes: u64) -> String {
     }
 }
 
-pub(crate) fn directory_listing(
-    url_prefix: &Path,
-    fs_path: &Path,
-    real_store: &Path,
-) -> ServerResult {
+/// Walks the directory and renders the table; runs on the blocking pool so a
+/// docs output with tens of thousands of entries cannot stall the worker
+/// thread it shares with unrelated downloads.
+fn render_listing(url_prefix: &Path, fs_path: &Path, real_store: &Path) -> anyhow::Result<String> {
     let path_without_store = fs_path.strip_prefix(real_store).unwrap_or(fs_path);
     let index_of = format!(
         "Index of {}",
         escape_html_entity(&path_without_store.to_string_lossy(), Html)
     );
-    let mut rows = String::new();
 
+    let mut entries = Vec::new();
     for entry in fs_path
         .read_dir()
         .with_context(|| format!("cannot read directory: {}", fs_path.display()))?
     {
         let entry = entry.unwrap();
+        if let Ok(metadata) = entry.metadata() {
+            entries.push((entry, metadata));
+        }
+    }
+    // directories first, each group sorted by name (readdir order is
+    // arbitrary on most filesystems)
+    entries.sort_unstable_by(|(a, am), (b, bm)| {
+        bm.is_dir()
+            .cmp(&am.is_dir())
+            .then_with(|| a.file_name().cmp(&b.file_name()))
+    });
+
+    let mut rows = String::new();
+    for (entry, metadata) in entries {
         let p = match entry.path().strip_prefix(fs_path) {
             Ok(p) => url_prefix.join(p).to_string_lossy().into_owned(),
             Err(_) => continue,
         };
 
         // if file is a directory, add '/' to the end of the name
-        if let Ok(metadata) = entry.metadata() {
-            if metadata.is_dir() {
-                let _ = writeln!(
-                    rows,
-                    "<tr><td><a href=\"{}\">{}/</a></td><td>-</td></tr>",
-                    encode_file_url!(p),
-                    encode_file_name!(entry),
-                );
-            } else {
-                let size = file_size(metadata.len());
-                let _ = writeln!(
-                    rows,
-                    "<tr><td><a href=\"{}\">{}</a></td><td>{size}</td></tr>",
-                    encode_file_url!(p),
-                    encode_file_name!(entry),
-                );
-            }
+        if metadata.is_dir() {
+            let _ = writeln!(
+                rows,
+                "<tr><td><a href=\"{}\">{}/</a></td><td>-</td></tr>",
+                encode_file_url!(p),
+                encode_file_name!(entry),
+            );
         } else {
-            continue;
+            let size = file_size(metadata.len());
+            let _ = writeln!(
+                rows,
+                "<tr><td><a href=\"{}\">{}</a></td><td>{size}</td></tr>",
+                encode_file_url!(p),
+                encode_file_name!(entry),
+            );
         }
     }
 
@@ -122,9 +135,41 @@ pub(crate) fn directory_listing(
     </div>
 </body>"#,
     );
+    Ok(html)
+}
+
+/// Rendered listing bodies by real path. Store contents are immutable, so a
+/// path's listing never changes; the small entry count bounds the memory
+/// spent on multi-MB bodies nobody browses anymore.
+static LISTING_CACHE: LazyLock<Cache<String, Bytes>> = LazyLock::new(|| Cache::new(128));
+
+const LISTING_CACHE_TTL: Duration = Duration::from_secs(24 * 60 * 60);
+
+pub(crate) async fn directory_listing(
+    url_prefix: &Path,
+    fs_path: &Path,
+    real_store: &Path,
+) -> ServerResult {
+    let key = fs_path.to_string_lossy().into_owned();
+    let body = match LISTING_CACHE.get(&key) {
+        Some(body) => body,
+        None => {
+            let url_prefix = url_prefix.to_owned();
+            let fs_path = fs_path.to_owned();
+            let real_store = real_store.to_owned();
+            let html = tokio::task::spawn_blocking(move || {
+                render_listing(&url_prefix, &fs_path, &real_store)
+            })
+            .await
+            .map_err(|e| anyhow::Error::from(e).context("Failed to join listing task"))??;
+            let body = Bytes::from(html);
+            LISTING_CACHE.insert(key, body.clone(), LISTING_CACHE_TTL);
+            body
+        }
+    };
     Ok(HttpResponse::Ok()
         .content_type("text/html; charset=utf-8")
-        .body(html))
+        .body(body))
 }
 
 pub(crate) async fn get(
@@ -162,13 +207,33 @@ pub(crate) async fn get(
             }
         }
 
+        // store contents are pinned by the hash, so hash + directory is a
+        // strong validator for the rendered listing; files below get theirs
+        // from NamedFile
+        let etag = format!(
+            "\"{}-{}\"",
+            hash,
+            utf8_percent_encode(&dir.to_string_lossy(), NON_ALPHANUMERIC)
+        );
+        if crate::revalidated(&req, &etag, None) {
+            return Ok(HttpResponse::NotModified()
+                .insert_header((http::header::ETAG, etag))
+                .finish());
+        }
+
         let url_prefix = PathBuf::from("/serve").join(&hash);
         let url_prefix = if dir == Path::new("") {
             url_prefix
         } else {
             url_prefix.join(dir)
         };
-        directory_listing(&url_prefix, &full_path, settings.store.real_store())
+        let mut res =
+            directory_listing(&url_prefix, &full_path, settings.store.real_store()).await?;
+        res.headers_mut().insert(
+            http::header::ETAG,
+            http::header::HeaderValue::from_str(&etag).map_err(anyhow::Error::from)?,
+        );
+        Ok(res)
     } else {
         Ok(NamedFile::open_async(&full_path)
             .await
@@ -10,6 +10,14 @@ use crate::config::SigningKey;
 // omitted: E O U T
 const BASE32_CHARS: &[u8] = b"0123456789abcdfghijklmnpqrsvwxyz";
 
+/// Matches libsodium's crypto_hash_sha256_state.
+#[repr(C)]
+struct Sha256State {
+    state: [u32; 8],
+    count: u64,
+    buf: [u8; 64],
+}
+
 #[link(name = "sodium")]
 extern "C" {
     fn crypto_sign_detached(
@@ -19,39 +27,103 @@ extern "C" {
         msg_len: usize,
         sk: *const u8,
     ) -> i32;
+
+    fn crypto_hash_sha256_init(state: *mut Sha256State) -> i32;
+    fn crypto_hash_sha256_update(state: *mut Sha256State, input: *const u8, input_len: u64) -> i32;
+    fn crypto_hash_sha256_final(state: *mut Sha256State, out: *mut u8) -> i32;
+}
+
+/// Streaming SHA-256, backed by libsodium like the signing primitives.
+pub(crate) struct Sha256(Sha256State);
+
+impl Sha256 {
+    pub(crate) fn new() -> Self {
+        let mut state = Sha256State {
+            state: [0; 8],
+            count: 0,
+            buf: [0; 64],
+        };
+        unsafe { crypto_hash_sha256_init(&mut state) };
+        Self(state)
+    }
+
+    pub(crate) fn update(&mut self, data: &[u8]) {
+        unsafe { crypto_hash_sha256_update(&mut self.0, data.as_ptr(), data.len() as u64) };
+    }
+
+    /// Returns the digest in the nix-base32 format used in narinfos.
+    pub(crate) fn finish_nix32(mut self) -> String {
+        let mut digest = [0u8; 32];
+        unsafe { crypto_hash_sha256_final(&mut self.0, digest.as_mut_ptr()) };
+        to_nix_base32(&digest)
+    }
 }
 
 /// Converts the given byte slice to a nix-compatible base32 encoded String.
-fn to_nix_base32(bytes: &[u8]) -> String {
+///
+/// Branch-free inner loop: the two source bytes are widened into one u16 so
+/// no shift needs a bounds or overflow check; with 32-byte sha256 digests
+/// this runs on every narinfo request.
+pub fn to_nix_base32(bytes: &[u8]) -> String {
+    if bytes.is_empty() {
+        return String::new();
+    }
     let len = (bytes.len() * 8 - 1) / 5 + 1;
 
-    (0..len)
-        .rev()
-        .map(|n| {
-            let b: usize = n * 5;
-            let i: usize = b / 8;
-            let j: usize = b % 8;
-            // bits from the lower byte
-            let v1 = bytes[i].checked_shr(j as u32).unwrap_or(0);
-            // bits from the upper byte
-            let v2 = if i >= bytes.len() - 1 {
-                0
-            } else {
-                bytes[i + 1].checked_shl(8 - j as u32).unwrap_or(0)
-            };
-            let v: usize = (v1 | v2) as usize;
-            char::from(BASE32_CHARS[v % BASE32_CHARS.len()])
-        })
-        .collect()
+    let mut out = Vec::with_capacity(len);
+    for n in (0..len).rev() {
+        let b = n * 5;
+        let i = b / 8;
+        let j = b % 8;
+        let lo = bytes[i] as u16 >> j;
+        let hi = if i + 1 < bytes.len() {
+            (bytes[i + 1] as u16) << (8 - j)
+        } else {
+            0
+        };
+        out.push(BASE32_CHARS[((lo | hi) & 0x1f) as usize]);
+    }
+    String::from_utf8(out).expect("base32 output is ASCII")
 }
 
-fn val(c: u8, idx: usize) -> Result<u8> {
-    match c {
-        b'A'..=b'F' => Ok(c - b'A' + 10),
-        b'a'..=b'f' => Ok(c - b'a' + 10),
-        b'0'..=b'9' => Ok(c - b'0'),
-        _ => bail!("invalid hex character: c: {}, index: {}", c as char, idx),
+const HEX_INVALID: u8 = 0xff;
+
+/// Maps an ASCII byte to its hex value, `HEX_INVALID` otherwise.
+const fn hex_table() -> [u8; 256] {
+    let mut table = [HEX_INVALID; 256];
+    let mut i = 0;
+    while i < 10 {
+        table[b'0' as usize + i] = i as u8;
+        i += 1;
+    }
+    let mut i = 0;
+    while i < 6 {
+        table[b'a' as usize + i] = 10 + i as u8;
+        table[b'A' as usize + i] = 10 + i as u8;
+        i += 1;
     }
+    table
+}
+
+static HEX_VALUES: [u8; 256] = hex_table();
+
+fn decode_hex_into(hex: &[u8], out: &mut [u8]) -> Result<()> {
+    for (i, (pair, byte)) in hex.chunks_exact(2).zip(out.iter_mut()).enumerate() {
+        let hi = HEX_VALUES[pair[0] as usize];
+        let lo = HEX_VALUES[pair[1] as usize];
+        if hi == HEX_INVALID {
+            bail!("invalid hex character: c: {}, index: {}", pair[0] as char, 2 * i);
+        }
+        if lo == HEX_INVALID {
+            bail!(
+                "invalid hex character: c: {}, index: {}",
+                pair[1] as char,
+                2 * i + 1
+            );
+        }
+        *byte = hi << 4 | lo;
+    }
+    Ok(())
 }
 
 fn from_hex<T: AsRef<[u8]>>(hex: T) -> Result<Vec<u8>> {
@@ -59,20 +131,25 @@ fn from_hex<T: AsRef<[u8]>>(hex: T) -> Result<Vec<u8>> {
     if hex.len() % 2 != 0 {
         bail!("Odd length");
     }
-
-    hex.chunks(2)
-        .enumerate()
-        .map(|(i, pair)| Ok(val(pair[0], 2 * i)? << 4 | val(pair[1], 2 * i + 1)?))
-        .collect()
+    let mut out = vec![0u8; hex.len() / 2];
+    decode_hex_into(hex, &mut out)?;
+    Ok(out)
 }
 
-pub(crate) fn convert_base16_to_nix32(hash_str: &str) -> Result<String> {
+pub fn convert_base16_to_nix32(hash_str: &str) -> Result<String> {
+    // the common case is a sha256 digest; decode it on the stack
+    if hash_str.len() == 64 {
+        let mut bytes = [0u8; 32];
+        decode_hex_into(hash_str.as_bytes(), &mut bytes)
+            .with_context(|| format!("Failed to convert hash: {}", hash_str))?;
+        return Ok(to_nix_base32(&bytes));
+    }
     let bytes =
         from_hex(hash_str).with_context(|| format!("Failed to convert hash: {}", hash_str))?;
     Ok(to_nix_base32(&bytes))
 }
 
-pub(crate) fn parse_secret_key(path: &Path) -> Result<SigningKey> {
+pub fn parse_secret_key(path: &Path) -> Result<SigningKey> {
     let sign_key = std::fs::read_to_string(path).context("Couldn't read sign_key file")?;
     let (sign_name, sign_key64) = sign_key
         .split_once(':')
@@ -93,7 +170,7 @@ pub(crate) fn parse_secret_key(path: &Path) -> Result<SigningKey> {
     ))
 }
 
-pub(crate) fn fingerprint_path(
+pub fn fingerprint_path(
     virtual_nix_store: &str,
     store_path: &str,
     nar_hash: &str,
@@ -131,7 +208,7 @@ pub(crate) fn fingerprint_path(
     )))
 }
 
-pub(crate) fn sign_string(sign_key: &SigningKey, msg: &str) -> String {
+pub fn sign_string(sign_key: &SigningKey, msg: &str) -> String {
     let mut signature = vec![0u8; 64]; // crypto_sign_BYTES -> 64
     let mut signature_len: usize = 0;
     let msg = msg.as_bytes();
@@ -161,6 +238,24 @@ mod test {
         path
     }
 
+    #[test]
+    fn test_base16_to_nix32() -> Result<()> {
+        // sha256 digest of the empty input, checked against `nix hash convert`
+        let base16 = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+        assert_eq!(
+            convert_base16_to_nix32(base16)?,
+            "0mdqa9w1p6cmli6976v4wi0sw9r4p5prkj7lzfd1877wk11c9c73"
+        );
+        // non-sha256 lengths take the generic path
+        assert_eq!(
+            convert_base16_to_nix32("deadbeef")?,
+            to_nix_base32(&[0xde, 0xad, 0xbe, 0xef])
+        );
+        assert!(convert_base16_to_nix32("abc").is_err());
+        assert!(convert_base16_to_nix32("zz").is_err());
+        Ok(())
+    }
+
     #[test]
     fn test_signing() -> Result<()> {
         let sign_key = test_assets_path().join("cache.sk");
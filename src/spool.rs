@@ -0,0 +1,247 @@
+use std::collections::HashMap;
+use std::path::PathBuf;
+use std::sync::{Arc, Mutex, Weak};
+
+use actix_web::web::{Bytes, BytesMut};
+use anyhow::{bail, Context, Result};
+use tempfile::TempPath;
+use tokio::fs::File;
+use tokio::io::{AsyncReadExt, AsyncWriteExt};
+use tokio::sync::{mpsc::Sender, watch};
+use tokio_stream::StreamExt;
+
+use crate::nar::{dump_path_windowed, AccountedStream, NarSink, ThreadSafeError};
+
+const READ_BUF_SIZE: usize = 256 * 1024;
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+enum SpoolStatus {
+    Running,
+    Done,
+    Failed,
+}
+
+#[derive(Debug, Clone, Copy)]
+struct SpoolState {
+    committed: u64,
+    status: SpoolStatus,
+}
+
+/// One in-progress (or recently finished) NAR serialization on disk.
+///
+/// The producer appends to the temp file and publishes the committed length
+/// through the watch channel; each subscriber reads the file behind that
+/// watermark at its own pace. The file is deleted when the last reference
+/// (producer and all subscribers) is gone.
+#[derive(Debug)]
+struct Spool {
+    path: TempPath,
+    progress: watch::Receiver<SpoolState>,
+}
+
+/// Single-flight registry for full NAR downloads: concurrent requests for the
+/// same nar hash share one serialization pass instead of each re-walking and
+/// re-reading the store path.
+#[derive(Debug, Default)]
+pub(crate) struct SpoolRegistry {
+    dir: PathBuf,
+    active: Mutex<HashMap<String, Weak<Spool>>>,
+}
+
+impl SpoolRegistry {
+    pub(crate) fn new(dir: PathBuf) -> Self {
+        Self {
+            dir,
+            active: Mutex::new(HashMap::new()),
+        }
+    }
+
+    fn spool(&self, key: &str, store_path: PathBuf, nar_size: u64) -> Result<Arc<Spool>> {
+        let mut active = self.active.lock().expect("spool registry lock poisoned");
+        active.retain(|_, spool| spool.strong_count() > 0);
+        if let Some(spool) = active.get(key).and_then(Weak::upgrade) {
+            return Ok(spool);
+        }
+
+        std::fs::create_dir_all(&self.dir)
+            .with_context(|| format!("Failed to create spool dir: {}", self.dir.display()))?;
+        let file = tempfile::Builder::new()
+            .prefix(".nar-spool-")
+            .tempfile_in(&self.dir)
+            .with_context(|| format!("Failed to create spool file in {}", self.dir.display()))?;
+        let (state_tx, state_rx) = watch::channel(SpoolState {
+            committed: 0,
+            status: SpoolStatus::Running,
+        });
+        let spool = Arc::new(Spool {
+            path: file.into_temp_path(),
+            progress: state_rx,
+        });
+        active.insert(key.to_owned(), Arc::downgrade(&spool));
+        tokio::task::spawn(produce(
+            store_path,
+            spool.path.to_path_buf(),
+            nar_size,
+            state_tx,
+        ));
+        Ok(spool)
+    }
+
+    /// Streams the NAR of `store_path` into `tx`, sharing one serialization
+    /// pass between all concurrent subscribers of `key`. Falls back to a
+    /// dedicated dump if the spool file cannot be set up.
+    pub(crate) fn subscribe(
+        &self,
+        key: &str,
+        store_path: PathBuf,
+        nar_size: u64,
+        tx: Sender<Result<Bytes, ThreadSafeError>>,
+    ) {
+        match self.spool(key, store_path.clone(), nar_size) {
+            Ok(spool) => {
+                tokio::task::spawn(consume(spool, tx));
+            }
+            Err(e) => {
+                log::warn!("Failed to set up NAR spool, dumping directly: {:#}", e);
+                tokio::task::spawn(dump_path_windowed(store_path, NarSink::full(tx)));
+            }
+        }
+    }
+}
+
+async fn produce(
+    store_path: PathBuf,
+    path: PathBuf,
+    nar_size: u64,
+    state: watch::Sender<SpoolState>,
+) {
+    match produce_inner(store_path.clone(), path, &state).await {
+        Ok(written) if written == nar_size => {
+            state.send_modify(|state| state.status = SpoolStatus::Done);
+        }
+        Ok(written) => {
+            log::error!(
+                "Spooled dump of {} produced {} bytes, expected {}",
+                store_path.display(),
+                written,
+                nar_size
+            );
+            state.send_modify(|state| state.status = SpoolStatus::Failed);
+        }
+        Err(e) => {
+            log::error!("Failed to spool NAR for {}: {:#}", store_path.display(), e);
+            state.send_modify(|state| state.status = SpoolStatus::Failed);
+        }
+    }
+}
+
+async fn produce_inner(
+    store_path: PathBuf,
+    path: PathBuf,
+    state: &watch::Sender<SpoolState>,
+) -> Result<u64> {
+    let (tx, rx) = tokio::sync::mpsc::channel::<Result<Bytes, ThreadSafeError>>(64);
+    tokio::task::spawn(dump_path_windowed(store_path, NarSink::full(tx)));
+    let mut rx = AccountedStream::new(rx);
+
+    let mut file = File::create(&path)
+        .await
+        .with_context(|| format!("Failed to open spool file: {}", path.display()))?;
+    let mut written = 0u64;
+    while let Some(chunk) = rx.next().await {
+        let chunk = chunk.context("Dump failed")?;
+        file.write_all(&chunk)
+            .await
+            .with_context(|| format!("Failed to write spool file: {}", path.display()))?;
+        written += chunk.len() as u64;
+        state.send_modify(|state| state.committed = written);
+    }
+    file.flush().await.context("Failed to flush spool file")?;
+    Ok(written)
+}
+
+async fn consume(spool: Arc<Spool>, tx: Sender<Result<Bytes, ThreadSafeError>>) {
+    if let Err(e) = consume_inner(&spool, &tx).await {
+        log::warn!("Failed to stream spooled NAR: {:#}", e);
+    }
+}
+
+async fn consume_inner(spool: &Spool, tx: &Sender<Result<Bytes, ThreadSafeError>>) -> Result<()> {
+    let mut progress = spool.progress.clone();
+    let mut file = File::open(&spool.path)
+        .await
+        .context("Failed to open spool file")?;
+    let mut pos = 0u64;
+    let mut buf = BytesMut::with_capacity(READ_BUF_SIZE);
+    loop {
+        let state = *progress.borrow_and_update();
+        if state.status == SpoolStatus::Failed {
+            bail!("NAR spool producer failed");
+        }
+        while pos < state.committed {
+            buf.reserve(READ_BUF_SIZE);
+            // reading past the watermark is fine: everything the producer has
+            // written so far is a valid prefix of the archive
+            let n = file
+                .read_buf(&mut buf)
+                .await
+                .context("Failed to read spool file")?;
+            if n == 0 {
+                bail!("Unexpected end of spool file");
+            }
+            pos += n as u64;
+            crate::metrics::NAR_BUFFERED_BYTES.add(n as u64);
+            if tx.send(Ok(buf.split().freeze())).await.is_err() {
+                // client went away
+                crate::metrics::NAR_BUFFERED_BYTES.sub(n as u64);
+                return Ok(());
+            }
+        }
+        if state.status == SpoolStatus::Done {
+            break;
+        }
+        if progress.changed().await.is_err() && progress.borrow().status == SpoolStatus::Running {
+            bail!("NAR spool producer vanished");
+        }
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[tokio::test]
+    async fn test_spool_fanout() -> Result<()> {
+        let temp_dir = tempfile::tempdir().context("Failed to create temp dir")?;
+        let dir = temp_dir.path().join("data");
+        std::fs::create_dir(&dir)?;
+        std::fs::write(dir.join("file"), vec![b'y'; 300_000])?;
+        std::fs::write(dir.join("other"), b"somecontent")?;
+
+        let (tx, mut rx) = tokio::sync::mpsc::channel::<Result<Bytes, ThreadSafeError>>(1000);
+        tokio::task::spawn(dump_path_windowed(dir.clone(), NarSink::full(tx)));
+        let mut expected = Vec::new();
+        while let Some(Ok(chunk)) = rx.recv().await {
+            expected.extend_from_slice(&chunk);
+        }
+
+        let registry = SpoolRegistry::new(temp_dir.path().join("spool"));
+        let mut handles = Vec::new();
+        for _ in 0..3 {
+            let (tx, mut rx) = tokio::sync::mpsc::channel::<Result<Bytes, ThreadSafeError>>(1000);
+            registry.subscribe("somekey", dir.clone(), expected.len() as u64, tx);
+            handles.push(tokio::task::spawn(async move {
+                let mut out = Vec::new();
+                while let Some(Ok(chunk)) = rx.recv().await {
+                    out.extend_from_slice(&chunk);
+                }
+                out
+            }));
+        }
+        for handle in handles {
+            assert_eq!(handle.await?, expected);
+        }
+        Ok(())
+    }
+}
@@ -1,24 +1,400 @@
-use crate::daemon::DaemonConnection;
+use crate::cache::Cache;
+use crate::daemon::{DaemonConnection, ValidPathInfo};
+use crate::db::NixDb;
+use crate::pathindex::PathIndex;
+use anyhow::Result;
 use core::str;
+use std::collections::VecDeque;
+use std::ops::{Deref, DerefMut};
 use std::path::Path;
 use std::path::PathBuf;
-use tokio::sync::Mutex;
+use std::sync::Arc;
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+use tokio::sync::{OwnedSemaphorePermit, Semaphore};
 
-#[derive(Default, Debug)]
+/// A pool of connections to the nix-daemon.
+///
+/// Connections are created lazily up to `max_connections`, handed out to one
+/// request at a time and parked in an idle list on release. Idle connections
+/// that have not been used for `idle_timeout` are dropped on the next
+/// checkout, but at least `min_connections` are always kept around.
+#[derive(Debug)]
+pub struct DaemonPool {
+    idle: Mutex<VecDeque<IdleConnection>>,
+    limit: Arc<Semaphore>,
+    min_connections: usize,
+    max_connections: usize,
+    idle_timeout: Duration,
+}
+
+#[derive(Debug)]
+struct IdleConnection {
+    conn: DaemonConnection,
+    since: Instant,
+}
+
+impl Default for DaemonPool {
+    fn default() -> Self {
+        Self::new(1, 32, Duration::from_secs(300))
+    }
+}
+
+impl DaemonPool {
+    pub fn new(min_connections: usize, max_connections: usize, idle_timeout: Duration) -> Self {
+        let max_connections = max_connections.max(1);
+        Self {
+            idle: Mutex::new(VecDeque::new()),
+            limit: Arc::new(Semaphore::new(max_connections)),
+            min_connections,
+            max_connections,
+            idle_timeout,
+        }
+    }
+
+    /// Checks out a connection, waiting if `max_connections` are already in use.
+    pub async fn get(&self) -> PooledConnection<'_> {
+        let wait_start = Instant::now();
+        let permit = self
+            .limit
+            .clone()
+            .acquire_owned()
+            .await
+            .expect("daemon pool semaphore closed");
+        crate::metrics::DAEMON_POOL_WAIT.observe(wait_start.elapsed());
+        let conn = {
+            let mut idle = self.idle.lock().expect("daemon pool lock poisoned");
+            while idle.len() > self.min_connections {
+                // the front is the oldest entry
+                match idle.front() {
+                    Some(entry) if entry.since.elapsed() > self.idle_timeout => {
+                        idle.pop_front();
+                    }
+                    _ => break,
+                }
+            }
+            idle.pop_back().map(|entry| entry.conn)
+        };
+        PooledConnection {
+            pool: self,
+            conn: Some(conn.unwrap_or_default()),
+            _permit: permit,
+        }
+    }
+
+    /// Establishes and handshakes up to `count` connections so the first
+    /// requests after a deploy do not pay connect plus handshake latency.
+    /// The connections are held concurrently (so each is a distinct socket)
+    /// and parked in the idle list afterwards; stops early if the daemon is
+    /// unreachable.
+    pub async fn prewarm(&self, count: usize) {
+        let count = count.min(self.max_connections);
+        let mut conns = Vec::with_capacity(count);
+        for _ in 0..count {
+            let mut conn = self.get().await;
+            if let Err(e) = conn.ensure_connected().await {
+                log::warn!("Failed to pre-connect to nix-daemon: {:#}", e);
+                return;
+            }
+            conns.push(conn);
+        }
+    }
+
+    /// Number of connections currently checked out.
+    pub fn in_use(&self) -> usize {
+        self.max_connections - self.limit.available_permits()
+    }
+
+    /// Number of connections parked in the idle list.
+    pub fn idle(&self) -> usize {
+        self.idle.lock().expect("daemon pool lock poisoned").len()
+    }
+
+    fn put_back(&self, conn: DaemonConnection) {
+        let mut idle = self.idle.lock().expect("daemon pool lock poisoned");
+        idle.push_back(IdleConnection {
+            conn,
+            since: Instant::now(),
+        });
+    }
+}
+
+/// A connection checked out of a `DaemonPool`, returned to the pool on drop.
+#[derive(Debug)]
+pub struct PooledConnection<'a> {
+    pool: &'a DaemonPool,
+    conn: Option<DaemonConnection>,
+    _permit: OwnedSemaphorePermit,
+}
+
+impl Deref for PooledConnection<'_> {
+    type Target = DaemonConnection;
+
+    fn deref(&self) -> &Self::Target {
+        self.conn.as_ref().unwrap()
+    }
+}
+
+impl DerefMut for PooledConnection<'_> {
+    fn deref_mut(&mut self) -> &mut Self::Target {
+        self.conn.as_mut().unwrap()
+    }
+}
+
+impl Drop for PooledConnection<'_> {
+    fn drop(&mut self) {
+        if let Some(conn) = self.conn.take() {
+            self.pool.put_back(conn);
+        }
+    }
+}
+
+/// Sizing and lifetime of the in-process metadata caches.
+#[derive(Debug, Clone, Copy)]
+pub struct CacheConfig {
+    pub entries: usize,
+    pub ttl: Duration,
+    /// TTL for cached misses; kept short so newly added paths show up quickly.
+    pub negative_ttl: Duration,
+}
+
+impl Default for CacheConfig {
+    fn default() -> Self {
+        Self {
+            entries: 32 * 1024,
+            ttl: Duration::from_secs(15 * 60),
+            negative_ttl: Duration::from_secs(10),
+        }
+    }
+}
+
+#[derive(Debug)]
 pub struct Store {
     virtual_store: String,
     real_store: Option<String>,
-    pub daemon: Mutex<DaemonConnection>,
+    daemon: DaemonPool,
+    /// When set, metadata lookups go straight to the Nix SQLite database
+    /// instead of the daemon.
+    nix_db: Option<NixDb>,
+    /// Persistent hash part -> basename index, probed before any backend.
+    index: Option<Arc<PathIndex>>,
+    cache_config: CacheConfig,
+    /// hash part -> store path (None caches a daemon miss)
+    resolution_cache: Cache<String, Option<String>>,
+    /// store path -> path info (None caches a daemon miss)
+    path_info_cache: Cache<String, Option<ValidPathInfo>>,
+}
+
+impl Default for Store {
+    fn default() -> Self {
+        Self::new(
+            String::new(),
+            None,
+            Default::default(),
+            None,
+            None,
+            Default::default(),
+        )
+    }
 }
 
 impl Store {
-    pub fn new(virtual_store: String, real_store: Option<String>) -> Self {
+    pub fn new(
+        virtual_store: String,
+        real_store: Option<String>,
+        daemon: DaemonPool,
+        nix_db: Option<NixDb>,
+        index: Option<Arc<PathIndex>>,
+        cache_config: CacheConfig,
+    ) -> Self {
         Self {
             virtual_store,
             real_store,
-            daemon: Default::default(),
+            daemon,
+            nix_db,
+            index,
+            cache_config,
+            resolution_cache: Cache::new(cache_config.entries),
+            path_info_cache: Cache::new(cache_config.entries),
         }
     }
+
+    /// Checks a daemon connection out of the pool.
+    pub async fn daemon(&self) -> PooledConnection<'_> {
+        self.daemon.get().await
+    }
+
+    pub fn daemon_pool(&self) -> &DaemonPool {
+        &self.daemon
+    }
+
+    fn cache_ttl<T>(&self, value: &Option<T>) -> Duration {
+        if value.is_some() {
+            self.cache_config.ttl
+        } else {
+            self.cache_config.negative_ttl
+        }
+    }
+
+    /// Fetches a path resolution from the configured metadata backend,
+    /// falling back to the daemon if the database is unavailable.
+    async fn fetch_path_from_hash_part(&self, hash_part: &str) -> Result<Option<String>> {
+        if let Some(index) = &self.index {
+            if let Some(basename) = index.lookup(hash_part) {
+                let store_path = format!("{}/{}", self.virtual_store, basename);
+                // verify before trusting: the index may predate a GC run
+                let real_path = self.get_real_path(Path::new(&store_path));
+                if tokio::fs::symlink_metadata(&real_path).await.is_ok() {
+                    return Ok(Some(store_path));
+                }
+                index.forget(hash_part);
+            }
+        }
+        let path = self.fetch_path_from_backend(hash_part).await?;
+        if let (Some(index), Some(path)) = (&self.index, &path) {
+            if let Some(basename) = Path::new(path).file_name().and_then(|name| name.to_str()) {
+                index.record(basename);
+            }
+        }
+        Ok(path)
+    }
+
+    async fn fetch_path_from_backend(&self, hash_part: &str) -> Result<Option<String>> {
+        if let Some(db) = &self.nix_db {
+            match db.query_path_from_hash_part(hash_part).await {
+                Ok(path) => return Ok(path),
+                Err(e) => {
+                    log::warn!("nix database lookup failed, falling back to daemon: {:#}", e)
+                }
+            }
+        }
+        let start = Instant::now();
+        let res = self
+            .daemon()
+            .await
+            .query_path_from_hash_part(hash_part)
+            .await;
+        crate::metrics::DAEMON_RPC_LATENCY.observe(start.elapsed());
+        res
+    }
+
+    async fn fetch_path_info(&self, store_path: &str) -> Result<Option<ValidPathInfo>> {
+        if let Some(db) = &self.nix_db {
+            match db.query_path_info(store_path).await {
+                Ok(info) => return Ok(info),
+                Err(e) => {
+                    log::warn!("nix database lookup failed, falling back to daemon: {:#}", e)
+                }
+            }
+        }
+        let start = Instant::now();
+        let res = self.daemon().await.query_path_info(store_path).await;
+        crate::metrics::DAEMON_RPC_LATENCY.observe(start.elapsed());
+        Ok(res?.path)
+    }
+
+    /// Resolves a hash part to a store path, consulting the cache first.
+    pub async fn query_path_from_hash_part(&self, hash_part: &str) -> Result<Option<String>> {
+        if let Some(path) = self.resolution_cache.get(&hash_part.to_owned()) {
+            crate::metrics::METADATA_CACHE_HITS.inc();
+            return Ok(path);
+        }
+        crate::metrics::METADATA_CACHE_MISSES.inc();
+        let path = self.fetch_path_from_hash_part(hash_part).await?;
+        self.resolution_cache
+            .insert(hash_part.to_owned(), path.clone(), self.cache_ttl(&path));
+        Ok(path)
+    }
+
+    /// Resolves many hash parts and fetches their path info in one batch.
+    ///
+    /// Cached entries are answered locally; the remaining misses are sent to
+    /// the daemon pipelined over a single pooled connection.
+    pub async fn query_path_infos_from_hash_parts(
+        &self,
+        hash_parts: &[String],
+    ) -> Result<Vec<Option<(String, ValidPathInfo)>>> {
+        let mut res: Vec<Option<Option<(String, ValidPathInfo)>>> = Vec::new();
+        let mut misses = Vec::new();
+        for hash_part in hash_parts {
+            let cached = self.resolution_cache.get(hash_part).and_then(|path| {
+                match path {
+                    // resolution hit: only usable if the info is cached too
+                    Some(path) => self
+                        .path_info_cache
+                        .get(&path)
+                        .map(|info| info.map(|info| (path, info))),
+                    None => Some(None),
+                }
+            });
+            if cached.is_none() {
+                crate::metrics::METADATA_CACHE_MISSES.inc();
+                misses.push(hash_part.clone());
+            } else {
+                crate::metrics::METADATA_CACHE_HITS.inc();
+            }
+            res.push(cached);
+        }
+        if !misses.is_empty() {
+            let fetched = if self.nix_db.is_some() {
+                // database lookups are local, no point in pipelining
+                let mut fetched = Vec::with_capacity(misses.len());
+                for hash_part in &misses {
+                    fetched.push(match self.fetch_path_from_hash_part(hash_part).await? {
+                        Some(path) => self
+                            .fetch_path_info(&path)
+                            .await?
+                            .map(|info| (path, info)),
+                        None => None,
+                    });
+                }
+                fetched
+            } else {
+                let start = Instant::now();
+                let res = self
+                    .daemon()
+                    .await
+                    .query_path_infos_from_hash_parts(&misses)
+                    .await;
+                crate::metrics::DAEMON_RPC_LATENCY.observe(start.elapsed());
+                res?
+            };
+            let mut fetched = fetched.into_iter();
+            let mut miss_hashes = misses.into_iter();
+            for slot in res.iter_mut() {
+                if slot.is_none() {
+                    let entry = fetched.next().unwrap();
+                    let hash_part = miss_hashes.next().unwrap();
+                    let path = entry.as_ref().map(|(path, _)| path.clone());
+                    self.resolution_cache
+                        .insert(hash_part, path.clone(), self.cache_ttl(&path));
+                    if let Some((path, info)) = &entry {
+                        self.path_info_cache.insert(
+                            path.clone(),
+                            Some(info.clone()),
+                            self.cache_config.ttl,
+                        );
+                    }
+                    *slot = Some(entry);
+                }
+            }
+        }
+        Ok(res.into_iter().map(|slot| slot.unwrap()).collect())
+    }
+
+    /// Looks up path info for a store path, consulting the cache first.
+    pub async fn query_path_info(&self, store_path: &str) -> Result<Option<ValidPathInfo>> {
+        if let Some(info) = self.path_info_cache.get(&store_path.to_owned()) {
+            crate::metrics::METADATA_CACHE_HITS.inc();
+            return Ok(info);
+        }
+        crate::metrics::METADATA_CACHE_MISSES.inc();
+        let info = self.fetch_path_info(store_path).await?;
+        self.path_info_cache
+            .insert(store_path.to_owned(), info.clone(), self.cache_ttl(&info));
+        Ok(info)
+    }
+
     pub fn get_real_path(&self, virtual_path: &Path) -> PathBuf {
         if self.real_store.is_some() && virtual_path.starts_with(&self.virtual_store) {
             return self
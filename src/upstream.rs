@@ -0,0 +1,85 @@
+//! Miss-proxying to upstream binary caches.
+//!
+//! When `upstream_caches` is configured, narinfo and NAR misses are queried
+//! against all upstreams concurrently and the first hit is streamed through,
+//! so builders behind a partial store don't pay a client-side substituter
+//! fallback on every miss. Bodies are not persisted locally: writing through
+//! into the store would need the daemon's ingestion ops, which this server
+//! deliberately doesn't speak.
+
+use std::pin::Pin;
+use std::time::Duration;
+
+use actix_web::{http, web, HttpRequest, HttpResponse};
+use futures_util::future::select_all;
+use futures_util::Future;
+
+use crate::config::Config;
+
+thread_local! {
+    // awc clients are per-thread by design; each actix worker keeps its own
+    // connector pool to the upstreams
+    static CLIENT: awc::Client = awc::Client::builder()
+        .timeout(Duration::from_secs(60))
+        .finish();
+}
+
+async fn fetch(base: &str, path: &str) -> Option<HttpResponse> {
+    let url = format!("{}/{}", base.trim_end_matches('/'), path);
+    let res = match CLIENT.with(|client| client.get(&url)).send().await {
+        Ok(res) => res,
+        Err(e) => {
+            log::warn!("upstream request to {} failed: {}", url, e);
+            return None;
+        }
+    };
+    if !res.status().is_success() {
+        return None;
+    }
+    let mut builder = HttpResponse::build(res.status());
+    for header in [http::header::CONTENT_TYPE, http::header::CACHE_CONTROL] {
+        if let Some(value) = res.headers().get(&header) {
+            builder.insert_header((header, value.clone()));
+        }
+    }
+    Some(builder.streaming(res))
+}
+
+/// Queries every upstream for `path` concurrently and streams the first
+/// successful response through. `None` when no upstream has it (or none are
+/// configured).
+pub(crate) async fn proxy(settings: &web::Data<Config>, path: &str) -> Option<HttpResponse> {
+    let mut pending: Vec<Pin<Box<dyn Future<Output = Option<HttpResponse>>>>> = settings
+        .upstream_caches
+        .iter()
+        .map(|base| {
+            let fut: Pin<Box<dyn Future<Output = Option<HttpResponse>>>> =
+                Box::pin(fetch(base, path));
+            fut
+        })
+        .collect();
+    while !pending.is_empty() {
+        let (res, _, rest) = select_all(pending).await;
+        if res.is_some() {
+            return res;
+        }
+        pending = rest;
+    }
+    None
+}
+
+/// Catch-all for `/nar/` URLs that no local route serves, like the
+/// compressed `.nar.xz` names in upstream narinfos we proxied through.
+pub(crate) async fn nar_fallback(req: HttpRequest, settings: web::Data<Config>) -> HttpResponse {
+    let path = req
+        .uri()
+        .path_and_query()
+        .map(|pq| pq.as_str())
+        .unwrap_or_else(|| req.uri().path());
+    match proxy(&settings, path.trim_start_matches('/')).await {
+        Some(res) => res,
+        None => HttpResponse::NotFound()
+            .insert_header(crate::cache_control_no_store())
+            .body("store path not found"),
+    }
+}
@@ -0,0 +1,263 @@
+//! Opt-in io_uring read engine for the NAR data plane.
+//!
+//! With many concurrent NAR downloads, tokio funnels every file read through
+//! its spawn_blocking pool, which becomes the bottleneck long before the
+//! disks do. When `io_engine = "uring"` is set, file contents are instead
+//! read by a small set of dedicated threads, each owning one ring with a
+//! registered buffer, so reads bypass the blocking pool entirely. Metadata
+//! (stat/readdir) stays on tokio: the prefetch window in `nar.rs` already
+//! hides its latency and it is not where the bytes move.
+//!
+//! Workers are scheduled per chunk, not per file: a slot in the reply
+//! channel is reserved before a chunk is queued, so delivering the bytes
+//! never blocks on the consumer and a handful of stalled clients cannot
+//! park every reader thread while hundreds of other downloads wait.
+
+use std::collections::VecDeque;
+use std::io;
+use std::os::fd::AsRawFd;
+use std::path::PathBuf;
+use std::sync::{Arc, Condvar, Mutex, OnceLock};
+
+use actix_web::web::Bytes;
+use io_uring::{opcode, types, IoUring};
+use tokio::sync::mpsc::{OwnedPermit, Receiver};
+use tokio::sync::oneshot;
+
+/// Size of the registered buffer, and thus of one read, per worker.
+const BUF_SIZE: usize = 256 * 1024;
+
+const RING_DEPTH: u32 = 8;
+
+/// One chunk-sized read. The reply slot is already reserved, so the worker
+/// hands the bytes over without ever waiting for the consumer.
+struct Chunk {
+    file: Arc<std::fs::File>,
+    offset: u64,
+    len: u64,
+    reply: OwnedPermit<io::Result<Bytes>>,
+    /// Bytes actually read, so the issuing task can advance its offset; an
+    /// error is routed here instead of the reply slot.
+    done: oneshot::Sender<io::Result<u64>>,
+}
+
+#[derive(Default)]
+struct JobQueue {
+    jobs: Mutex<VecDeque<Chunk>>,
+    available: Condvar,
+}
+
+impl JobQueue {
+    fn push(&self, job: Chunk) {
+        self.jobs.lock().expect("uring queue poisoned").push_back(job);
+        self.available.notify_one();
+    }
+
+    fn pop(&self) -> Chunk {
+        let mut jobs = self.jobs.lock().expect("uring queue poisoned");
+        loop {
+            match jobs.pop_front() {
+                Some(job) => return job,
+                None => jobs = self.available.wait(jobs).expect("uring queue poisoned"),
+            }
+        }
+    }
+}
+
+pub(crate) struct UringEngine {
+    queue: Arc<JobQueue>,
+}
+
+static ENGINE: OnceLock<UringEngine> = OnceLock::new();
+
+/// The configured engine, if `io_engine = "uring"` and ring setup succeeded.
+pub(crate) fn engine() -> Option<&'static UringEngine> {
+    ENGINE.get()
+}
+
+/// Probes io_uring support and starts `workers` reader threads. Falls back to
+/// the tokio read path (with a warning) when rings cannot be created, e.g. in
+/// containers that filter the syscalls.
+pub(crate) fn init(workers: usize) {
+    if let Err(e) = IoUring::new(RING_DEPTH) {
+        log::warn!(
+            "io_uring unavailable, falling back to tokio file I/O: {}",
+            e
+        );
+        return;
+    }
+    let queue = Arc::new(JobQueue::default());
+    for i in 0..workers.max(1) {
+        let queue = queue.clone();
+        std::thread::Builder::new()
+            .name(format!("uring-reader-{}", i))
+            .spawn(move || worker(&queue))
+            .expect("failed to spawn uring reader thread");
+    }
+    let _ = ENGINE.set(UringEngine { queue });
+}
+
+impl UringEngine {
+    /// Queues a read of `len` bytes of `path` starting at `offset`; the
+    /// chunks arrive on the returned channel in order. Errors (including
+    /// short files) are delivered in-band, after which the channel closes.
+    ///
+    /// The spawned task queues one chunk at a time and only after reserving
+    /// its reply slot, so the consumer's pace throttles its own job while
+    /// the worker threads stay available to everyone else.
+    pub(crate) fn read(&self, path: PathBuf, offset: u64, len: u64) -> Receiver<io::Result<Bytes>> {
+        let (tx, rx) = tokio::sync::mpsc::channel(4);
+        let queue = self.queue.clone();
+        tokio::task::spawn(async move {
+            let file = match tokio::fs::File::open(&path).await {
+                Ok(file) => Arc::new(file.into_std().await),
+                Err(e) => {
+                    let _ = tx.send(Err(e)).await;
+                    return;
+                }
+            };
+            let mut offset = offset;
+            let mut left = len;
+            while left > 0 {
+                let reply = match tx.clone().reserve_owned().await {
+                    Ok(reply) => reply,
+                    Err(_) => return, // client went away
+                };
+                let (done, read) = oneshot::channel();
+                queue.push(Chunk {
+                    file: file.clone(),
+                    offset,
+                    len: left.min(BUF_SIZE as u64),
+                    reply,
+                    done,
+                });
+                match read.await {
+                    Ok(Ok(n)) => {
+                        offset += n;
+                        left -= n;
+                    }
+                    Ok(Err(e)) => {
+                        // the worker dropped the reserved slot, so this
+                        // cannot block
+                        let _ = tx.send(Err(e)).await;
+                        return;
+                    }
+                    Err(_) => return, // worker thread died
+                }
+            }
+        });
+        rx
+    }
+}
+
+fn worker(queue: &JobQueue) {
+    let mut ring = match IoUring::new(RING_DEPTH) {
+        Ok(ring) => ring,
+        Err(e) => {
+            log::error!("Failed to create io_uring: {}", e);
+            return;
+        }
+    };
+    let mut buf = vec![0u8; BUF_SIZE].into_boxed_slice();
+    let iovec = libc::iovec {
+        iov_base: buf.as_mut_ptr() as *mut libc::c_void,
+        iov_len: buf.len(),
+    };
+    // Safety: the buffer lives for the whole thread and is only handed to
+    // one read at a time below.
+    if let Err(e) = unsafe { ring.submitter().register_buffers(&[iovec]) } {
+        log::error!("Failed to register io_uring buffer: {}", e);
+        return;
+    }
+
+    loop {
+        let chunk = queue.pop();
+        match read_chunk(&mut ring, &mut buf, &chunk) {
+            Ok(data) => {
+                let n = data.len() as u64;
+                chunk.reply.send(Ok(data));
+                let _ = chunk.done.send(Ok(n));
+            }
+            Err(e) => {
+                // release the reserved slot so the issuing task can deliver
+                // the error in-band
+                drop(chunk.reply);
+                let _ = chunk.done.send(Err(e));
+            }
+        }
+    }
+}
+
+fn read_chunk(ring: &mut IoUring, buf: &mut [u8], chunk: &Chunk) -> io::Result<Bytes> {
+    let fd = types::Fd(chunk.file.as_raw_fd());
+    let want = chunk.len.min(buf.len() as u64) as u32;
+    let read = opcode::ReadFixed::new(fd, buf.as_mut_ptr(), want, 0)
+        .offset(chunk.offset)
+        .build();
+    // Safety: buffer and fd stay valid until the completion is reaped
+    // right below.
+    unsafe {
+        ring.submission()
+            .push(&read)
+            .map_err(|e| io::Error::other(e))?;
+    }
+    ring.submit_and_wait(1)?;
+    let cqe = ring
+        .completion()
+        .next()
+        .ok_or_else(|| io::Error::other("io_uring completion queue empty"))?;
+    let n = cqe.result();
+    if n < 0 {
+        return Err(io::Error::from_raw_os_error(-n));
+    }
+    if n == 0 {
+        return Err(io::Error::new(
+            io::ErrorKind::UnexpectedEof,
+            "unexpected end of file",
+        ));
+    }
+    Ok(Bytes::copy_from_slice(&buf[..n as usize]))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[tokio::test]
+    async fn test_uring_read() {
+        let ring = match IoUring::new(RING_DEPTH) {
+            Ok(ring) => ring,
+            // not supported in all build environments
+            Err(_) => return,
+        };
+        drop(ring);
+        init(1);
+        let engine = engine().expect("engine not initialized");
+
+        let temp_dir = tempfile::tempdir().unwrap();
+        let path = temp_dir.path().join("data");
+        let content: Vec<u8> = (0..BUF_SIZE * 2 + 17).map(|i| i as u8).collect();
+        std::fs::write(&path, &content).unwrap();
+
+        let mut rx = engine.read(path, 3, content.len() as u64 - 3);
+        let mut out = Vec::new();
+        while let Some(chunk) = rx.recv().await {
+            out.extend_from_slice(&chunk.unwrap());
+        }
+        assert_eq!(out, content[3..]);
+
+        // a stalled consumer must not park the single worker: with the one
+        // reply slot per queued chunk, this read makes progress even though
+        // another receiver is never drained
+        let blocked_path = temp_dir.path().join("blocked");
+        std::fs::write(&blocked_path, vec![0u8; BUF_SIZE * 8]).unwrap();
+        let _stalled = engine.read(blocked_path, 0, (BUF_SIZE * 8) as u64);
+
+        let mut rx = engine.read(temp_dir.path().join("data"), 0, content.len() as u64);
+        let mut out = Vec::new();
+        while let Some(chunk) = rx.recv().await {
+            out.extend_from_slice(&chunk.unwrap());
+        }
+        assert_eq!(out, content);
+    }
+}
@@ -0,0 +1,131 @@
+//! Pre-warming endpoint for scheduled rollouts.
+//!
+//! `POST /warm` takes a JSON array of store paths and computes everything the
+//! hot path needs before the first client asks: the metadata and signature
+//! caches (via the narinfo machinery), the rendered `.ls` bodies, the
+//! hash-part index, and — when the compressed-NAR cache is configured — its
+//! entries. Warming runs in the background with bounded concurrency so a
+//! pushed closure cannot starve live traffic, and compression jobs go
+//! through the nar cache's own semaphore like any other.
+
+use std::error::Error;
+use std::path::Path;
+
+use actix_web::{http, web, HttpRequest, HttpResponse};
+use futures_util::StreamExt;
+
+use crate::config::Config;
+
+/// The largest number of store paths accepted by a single request.
+const MAX_BATCH_SIZE: usize = 4096;
+
+/// Extracts the hash part from a full store path under `virtual_store`.
+pub(crate) fn hash_part<'a>(virtual_store: &str, store_path: &'a str) -> Option<&'a str> {
+    let basename = Path::new(store_path)
+        .strip_prefix(virtual_store)
+        .ok()?
+        .to_str()?;
+    if basename.len() < 32 {
+        return None;
+    }
+    Some(&basename[..32])
+}
+
+fn authorized(req: &HttpRequest, token: &str) -> bool {
+    req.headers()
+        .get(http::header::AUTHORIZATION)
+        .and_then(|value| value.to_str().ok())
+        .and_then(|value| value.strip_prefix("Bearer "))
+        .map(|value| value == token)
+        .unwrap_or(false)
+}
+
+async fn warm_one(settings: &web::Data<Config>, store_path: &str) {
+    let hash = match hash_part(settings.store.virtual_store(), store_path) {
+        Some(hash) => hash,
+        None => {
+            log::warn!("warming: not a store path, skipping: {}", store_path);
+            return;
+        }
+    };
+    // resolve through the store so the metadata cache and the hash index see
+    // the path, and so we only warm what actually exists
+    let store_path = match settings.store.query_path_from_hash_part(hash).await {
+        Ok(Some(store_path)) => store_path,
+        Ok(None) => {
+            log::warn!("warming: path not in store, skipping: {}", store_path);
+            return;
+        }
+        Err(e) => {
+            log::warn!("warming: lookup failed for {}: {:#}", store_path, e);
+            return;
+        }
+    };
+
+    // narinfo + signatures; this also queues background compression when the
+    // compressed-NAR cache is configured
+    match crate::narinfo::query_narinfo(
+        settings.store.virtual_store(),
+        &store_path,
+        hash,
+        &settings.secret_keys.get(),
+        settings,
+    )
+    .await
+    {
+        Ok(Some(mut narinfo)) => {
+            crate::narinfo::apply_compression(settings, &mut narinfo, true).await;
+        }
+        Ok(None) => return,
+        Err(e) => {
+            log::warn!("warming: narinfo failed for {}: {:#}", store_path, e);
+            return;
+        }
+    }
+
+    let real_path = settings.store.get_real_path(Path::new(&store_path));
+    if let Err(e) = crate::narlist::cached_body(real_path).await {
+        log::warn!("warming: .ls failed for {}: {:#}", store_path, e);
+    }
+}
+
+pub(crate) async fn post(
+    paths: web::Json<Vec<String>>,
+    req: HttpRequest,
+    settings: web::Data<Config>,
+) -> Result<HttpResponse, Box<dyn Error>> {
+    let token = match &settings.warming_token {
+        Some(token) => token,
+        None => {
+            return Ok(HttpResponse::NotFound()
+                .insert_header(crate::cache_control_no_store())
+                .body("warming not configured"))
+        }
+    };
+    if !authorized(&req, token) {
+        return Ok(HttpResponse::Unauthorized()
+            .insert_header(crate::cache_control_no_store())
+            .body("missing or wrong bearer token"));
+    }
+
+    let paths = paths.into_inner();
+    if paths.len() > MAX_BATCH_SIZE {
+        return Ok(HttpResponse::BadRequest()
+            .body(format!("too many paths, maximum is {}", MAX_BATCH_SIZE)));
+    }
+
+    let queued = paths.len();
+    let jobs = settings.warming_jobs.max(1);
+    let background = settings.clone();
+    tokio::task::spawn(async move {
+        futures_util::stream::iter(paths)
+            .for_each_concurrent(jobs, |path| {
+                let settings = background.clone();
+                async move { warm_one(&settings, &path).await }
+            })
+            .await;
+        log::info!("warming finished for {} paths", queued);
+    });
+
+    Ok(HttpResponse::Accepted().body(format!("warming {} paths\n", queued)))
+}